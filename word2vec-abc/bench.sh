@@ -0,0 +1,58 @@
+#!/bin/bash
+# Trains word2vec over a matrix of configurations on a synthetic Zipf corpus and
+# collects one CSV row per run (words/sec, phase timing, peak RSS) in $OUT/bench.csv.
+# No download needed; every list below can be overridden from the environment, e.g.
+#   THREADS="1 2 4 8 16" SIZES=200 make bench
+
+set -e
+
+OUT=${OUT:-bench-out}
+WORDS=${WORDS:-5000000}
+VOCAB=${VOCAB:-100000}
+SEED=${SEED:-1}
+CBOWS=${CBOWS:-"0 1"}
+MODES=${MODES:-"hs neg"}
+NEGATIVE=${NEGATIVE:-5}
+SIZES=${SIZES:-"100"}
+WINDOWS=${WINDOWS:-"5"}
+THREADS=${THREADS:-"1 $(nproc)"}
+ITER=${ITER:-1}
+REPEAT=${REPEAT:-1}
+
+mkdir -p $OUT
+CORPUS=$OUT/zipf-$WORDS-$VOCAB-$SEED.txt
+if [ ! -e $CORPUS ]; then
+  ./zipf-corpus -output $CORPUS -words $WORDS -vocab $VOCAB -seed $SEED
+fi
+
+rm -f $OUT/bench.csv
+for cbow in $CBOWS; do
+for mode in $MODES; do
+  if [ $mode = hs ]; then opts="-hs 1 -negative 0"; else opts="-hs 0 -negative $NEGATIVE"; fi
+for size in $SIZES; do
+for window in $WINDOWS; do
+for threads in $THREADS; do
+for r in $(seq $REPEAT); do
+  echo "cbow=$cbow $mode size=$size window=$window threads=$threads"
+  ./word2vec -train $CORPUS -output $OUT/vectors.bin -binary 1 -debug 0 \
+    -cbow $cbow $opts -size $size -window $window -threads $threads -iter $ITER \
+    -report $OUT/bench.csv > /dev/null
+done
+done
+done
+done
+done
+done
+rm -f $OUT/vectors.bin
+
+# the same rows as JSON, one object per run
+awk -F, 'NR == 1 { for (i = 1; i <= NF; i++) h[i] = $i; print "["; next }
+  { printf "%s  {", (NR > 2 ? ",\n" : "")
+    for (i = 1; i <= NF; i++) {
+      v = (i == 1) ? "\"" $i "\"" : $i
+      printf "%s\"%s\": %s", (i > 1 ? ", " : ""), h[i], v
+    }
+    printf "}" }
+  END { print "\n]" }' $OUT/bench.csv > $OUT/bench.json
+
+column -s, -t < $OUT/bench.csv 2> /dev/null || cat $OUT/bench.csv
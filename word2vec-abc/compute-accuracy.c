@@ -0,0 +1,253 @@
+//  Copyright 2013 Google Inc. All Rights Reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+// Accuracy of word vectors on analogy questions, as the original compute-accuracy:
+// for a question "a b c d" (a is to b as c is to d) the answer is right if d is the
+// closest word to b - a + c, with a, b and c left out, among the first threshold
+// (most frequent) words. Words and questions are compared upper cased.
+// The questions come from a local file (e.g. questions-words.txt), in sections
+// that start with ": name"; the sections whose name starts with "gram" are
+// syntactic, the others semantic.
+
+// how it works
+// * the vectors are read and normalized once (see vectors.h)
+// * the questions of a section are answered in batches - the scores of a batch are the
+//   product of the batch matrix Q (a row b - a + c per question) with the matrix M
+// * M is split in row ranges over the threads; each thread walks its range in blocks of
+//   ROW_BLOCK rows and scores every block against the whole batch while it is in the
+//   cache, with the 2 rows x 4 questions tile kernels of tile.h
+// * every thread keeps the best word of each question, the best of the threads wins
+//   (the first word of equal scores, like the scan of the original)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "vectors.h"
+
+#define MAX_STRING 100
+#define MAX_LINE 1000
+#define QUERY_BLOCK 4 // questions of a kernel tile
+#define ROW_BLOCK 64 // rows scored against a whole batch at a time
+
+char file_name[MAX_STRING], questions_file[MAX_STRING];
+long long threshold = 0;
+int num_threads = 0, batch = 1024;
+struct vectors vec;
+
+// the current batch
+// * question - the vocab indices of a, b, c and d of each question
+// * Q - b - a + c of each question, rounded up to QUERY_BLOCK rows
+// * best_score, best_word - [thread][question] the best word of each thread
+long long (*question)[4];
+long long nq;
+real * Q;
+real * best_score;
+long long * best_word;
+
+void *AnswerThread(void *id) {
+	long long pairs = vec.rows / 2, r, r0, r1, j, qi, q, w;
+	long long start = pairs * (long long)id / num_threads * 2, end = pairs * ((long long)id + 1) / num_threads * 2;
+	real s[2 * QUERY_BLOCK], * bs = best_score + (long long)id * batch;
+	long long * bw = best_word + (long long)id * batch;
+	for (r0 = start; r0 < end; r0 += ROW_BLOCK) {
+		r1 = (r0 + ROW_BLOCK < end) ? r0 + ROW_BLOCK : end;
+		for (qi = 0; qi < nq; qi += QUERY_BLOCK) {
+			for (r = r0; r < r1; r += 2) {
+				vec.tile(vec.M + r * vec.stride, Q + qi * vec.stride, vec.stride, s);
+				for (j = 0; j < 2 * QUERY_BLOCK; j++) {
+					q = qi + j % QUERY_BLOCK;
+					if ((q >= nq) || (s[j] <= bs[q])) continue;
+					w = r + j / QUERY_BLOCK;
+					if ((w >= vec.words) || (w == question[q][0]) || (w == question[q][1]) || (w == question[q][2])) continue;
+					bs[q] = s[j];
+					bw[q] = w;
+				}
+			}
+		}
+	}
+	pthread_exit(NULL);
+}
+
+// answers the batch, returns how many answers are right
+long long AnswerBatch() {
+	long long a, b, q, correct = 0;
+	pthread_t * pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+	real * v;
+	for (q = 0; q < nq; q++) {
+		v = Q + q * vec.stride;
+		for (b = 0; b < vec.stride; b++)
+			v[b] = VectorsRow(&vec, question[q][1])[b] - VectorsRow(&vec, question[q][0])[b] + VectorsRow(&vec, question[q][2])[b];
+	}
+	// the kernels read QUERY_BLOCK rows at a time, the rows past nq are zero
+	memset(Q + nq * vec.stride, 0, ((nq + QUERY_BLOCK - 1) / QUERY_BLOCK * QUERY_BLOCK - nq) * vec.stride * sizeof(real));
+	for (a = 0; a < (long long)num_threads * batch; a++) {
+		best_score[a] = -1e30;
+		best_word[a] = -1;
+	}
+	for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, AnswerThread, (void *)a);
+	for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+	free(pt);
+	// the threads have consecutive row ranges, so > keeps the first of equal scores
+	for (q = 0; q < nq; q++) {
+		for (a = 1; a < num_threads; a++) if (best_score[a * batch + q] > best_score[q]) {
+			best_score[q] = best_score[a * batch + q];
+			best_word[q] = best_word[a * batch + q];
+		}
+		if (best_word[q] == question[q][3]) correct++;
+	}
+	return correct;
+}
+
+double SecondsSince(struct timespec * t) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) + (now.tv_nsec - t->tv_nsec) / 1e9;
+}
+
+void Evaluate() {
+	// TCN / CCN - questions / right answers of the section, TACN / CACN - of all the
+	// sections, SECN / SEAC and SYCN / SYAC - semantic and syntactic ones,
+	// TQ - questions with all the words known, TQS - all the questions
+	long long TCN = 0, CCN = 0, TACN = 0, CACN = 0, SECN = 0, SEAC = 0, SYCN = 0, SYAC = 0, TQ = 0, TQS = 0;
+	long long a, w[4];
+	char line[MAX_LINE], st[4][MAX_LINE], section[MAX_LINE];
+	int syntactic = 0, eof = 0, n = 0;
+	double secs, total_secs = 0;
+	struct timespec t;
+	FILE * fin = stdin;
+	if (questions_file[0] != 0) fin = fopen(questions_file, "rb");
+	if (fin == NULL) {
+		printf("ERROR: questions file not found!\n");
+		exit(1);
+	}
+	section[0] = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	while (!eof) {
+		eof = (fgets(line, MAX_LINE, fin) == NULL);
+		if (!eof) {
+			for (a = 0; line[a]; a++) line[a] = toupper(line[a]);
+			n = sscanf(line, "%s %s %s %s", st[0], st[1], st[2], st[3]);
+		}
+		// a full batch, a new section or the end - answer the questions so far
+		if ((nq == batch) || eof || ((n >= 1) && !strcmp(st[0], ":"))) {
+			a = AnswerBatch();
+			CCN += a;
+			CACN += a;
+			if (syntactic) SYAC += a; else SEAC += a;
+			nq = 0;
+		}
+		if (eof || ((n >= 1) && !strcmp(st[0], ":"))) {
+			if (TCN > 0) {
+				secs = SecondsSince(&t);
+				total_secs += secs;
+				printf("%s:\n", section);
+				printf("ACCURACY TOP1: %.2f %%  (%lld / %lld)\n", CCN / (float)TCN * 100, CCN, TCN);
+				printf("Total accuracy: %.2f %%   Semantic accuracy: %.2f %%   Syntactic accuracy: %.2f %% \n",
+					CACN / (float)TACN * 100, SECN ? SEAC / (float)SECN * 100 : 0, SYCN ? SYAC / (float)SYCN * 100 : 0);
+				printf("Time: %.2f s, %.0f questions/s\n", secs, TCN / (secs > 0 ? secs : 1));
+				fflush(stdout);
+			}
+			if (eof) break;
+			if (n < 2) strcpy(st[1], "");
+			strcpy(section, st[1]);
+			// the names are upper cased like the words
+			syntactic = !strncmp(section, "GRAM", 4);
+			TCN = 0;
+			CCN = 0;
+			clock_gettime(CLOCK_MONOTONIC, &t);
+			continue;
+		}
+		if (n < 4) continue;
+		TQS++;
+		for (a = 0; a < 4; a++) if ((w[a] = SearchWord(&vec, st[a])) == -1) break;
+		if (a < 4) continue;
+		TQ++;
+		memcpy(question[nq++], w, sizeof(w));
+		TCN++;
+		TACN++;
+		if (syntactic) SYCN++; else SECN++;
+	}
+	if (fin != stdin) fclose(fin);
+	printf("Questions seen / total: %lld %lld   %.2f %% \n", TQ, TQS, TQS ? TQ / (float)TQS * 100 : 0);
+	printf("Total time: %.2f s, %.0f questions/s\n", total_secs, TQ / (total_secs > 0 ? total_secs : 1));
+}
+
+int ArgPos(char *str, int argc, char **argv) {
+	int a;
+	for (a = 1; a < argc; a++) if (!strcmp(str, argv[a])) {
+		if (a == argc - 1) {
+			printf("Argument missing for %s\n", str);
+			exit(1);
+		}
+		return a;
+	}
+	return -1;
+}
+
+int main(int argc, char **argv) {
+	long long a;
+	int i;
+	char * upper;
+	if (argc < 2) {
+		printf("Usage: ./compute-accuracy <FILE> [<threshold>] [options] < <questions>\nwhere FILE contains word projections in any of the formats of word2vec -binary, and threshold is used to reduce vocabulary of the model for fast approximate evaluation (0 = off, otherwise typical value is 30000)\n\n");
+		printf("Options:\n");
+		printf("\t-questions <file>\n");
+		printf("\t\tRead the questions from <file>; default is stdin\n");
+		printf("\t-batch <int>\n");
+		printf("\t\tNumber of questions answered together; default is 1024\n");
+		printf("\t-threads <int>\n");
+		printf("\t\tUse <int> threads; default is the number of cpus\n");
+		printf("\nExamples:\n");
+		printf("./compute-accuracy vectors.bin 30000 < questions-words.txt\n");
+		printf("./compute-accuracy vectors.bin 30000 -questions questions-words.txt -threads 8\n\n");
+		return 0;
+	}
+	strcpy(file_name, argv[1]);
+	if ((argc > 2) && (argv[2][0] != '-')) threshold = atoll(argv[2]);
+	questions_file[0] = 0;
+	if ((i = ArgPos((char *)"-questions", argc, argv)) > 0) strcpy(questions_file, argv[i + 1]);
+	if ((i = ArgPos((char *)"-batch", argc, argv)) > 0) batch = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
+	if (num_threads < 1) num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (batch < 1) {
+		printf("ERROR: -batch must be positive\n");
+		return 1;
+	}
+	InitVectorKernels(&vec);
+	ReadVectors(&vec, file_name, threshold, num_threads);
+	// upper cased words in a copy (the strings of a mapped model are read only)
+	upper = (char *)malloc(vec.offsets[vec.words]);
+	if (upper == NULL) {
+		printf("Memory allocation failed\n");
+		return 1;
+	}
+	for (a = 0; a < vec.offsets[vec.words]; a++) upper[a] = toupper(vec.strings[a]);
+	vec.strings = upper;
+	InitLookup(&vec);
+	question = (long long (*)[4])malloc(batch * sizeof(*question));
+	if (posix_memalign((void **)&Q, 64, (batch + QUERY_BLOCK) * vec.stride * sizeof(real))) Q = NULL;
+	best_score = (real *)malloc((long long)num_threads * batch * sizeof(real));
+	best_word = (long long *)malloc((long long)num_threads * batch * sizeof(long long));
+	if ((question == NULL) || (Q == NULL) || (best_score == NULL) || (best_word == NULL)) {
+		printf("Memory allocation failed\n");
+		return 1;
+	}
+	Evaluate();
+	return 0;
+}
@@ -0,0 +1,358 @@
+//  Copyright 2013 Google Inc. All Rights Reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+// Nearest neighbours (cosine) of words and sentences in the vectors written by word2vec,
+// in any of its -binary formats (text, binary or the mapped model of model.h)
+
+// how it works
+// * the vectors are normalized ONCE at load time, so a cosine is a plain dot product
+// * queries are answered in batches - the scores of a batch are the product of the
+//   query matrix Q (batch x size) with the transposed vector matrix M (words x size)
+// * M is split in row ranges over the threads; each thread walks its range in blocks of
+//   ROW_BLOCK rows and scores every block against the whole batch while the block is
+//   in the cache, so M is read from memory once per batch instead of once per query
+// * the kernels score a tile of 2 rows x 4 queries per call (8 accumulators)
+// * every thread keeps a top-k min heap per query; the heaps are merged at the end
+// * with -ef the queries walk the HNSW graph of <FILE>.hnsw (see hnsw.h, built by
+//   word2vec -hnsw) instead, one query per thread at a time - approximate, much faster
+// interactive (a terminal on stdin) it behaves like the original distance, otherwise
+// it reads one query per line and prints "query<TAB>word<TAB>cosine" lines
+
+// main datastructure
+// * vec - the normalized vectors M, their words and hash table (see vectors.h)
+// * Q - the normalized query vectors of the current batch, rounded up to QUERY_BLOCK rows
+// * heap_score, heap_word - [thread][query][top] the best candidates of each thread
+// * graph, searches - the HNSW graph and the working memory of each thread for it
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "vectors.h"
+#include "hnsw.h"
+
+#define MAX_STRING 100
+#define MAX_QUERY 2000 // longest query line
+#define MAX_QUERY_WORDS 100
+#define QUERY_BLOCK 4 // queries of a kernel tile
+#define ROW_BLOCK 64 // rows scored against a whole batch at a time
+
+char file_name[MAX_STRING], queries_file[MAX_STRING];
+int top = 40, num_threads = 0, batch = 256, debug_mode = 1, ef = 0;
+struct vectors vec;
+
+// the current batch
+struct query {
+	char text[MAX_QUERY];
+	long long word[MAX_QUERY_WORDS]; // vocab indices of its words (excluded from the results)
+	int n;
+};
+struct query * qs;
+long long nq;
+real * Q;
+real * heap_score;
+long long * heap_word;
+struct hnsw graph;
+struct hnsw_search * searches;
+
+
+// replaces the smallest of a full min heap of n candidates
+static inline void HeapReplace(real * score, long long * word, int n, real s, long long w) {
+	int i = 0, c;
+	while ((c = 2 * i + 1) < n) {
+		if ((c + 1 < n) && (score[c + 1] < score[c])) c++;
+		if (s <= score[c]) break;
+		score[i] = score[c];
+		word[i] = word[c];
+		i = c;
+	}
+	score[i] = s;
+	word[i] = w;
+}
+
+static inline int InQuery(struct query * q, long long w) {
+	int a;
+	for (a = 0; a < q->n; a++) if (q->word[a] == w) return 1;
+	return 0;
+}
+
+void *SearchThread(void *id) {
+	// this thread's range of row pairs, block by block against the whole batch
+	long long pairs = vec.rows / 2, r, r0, r1, j, qi, w;
+	long long start = pairs * (long long)id / num_threads * 2, end = pairs * ((long long)id + 1) / num_threads * 2;
+	real s[2 * QUERY_BLOCK], * hs;
+	long long * hw;
+	for (r0 = start; r0 < end; r0 += ROW_BLOCK) {
+		r1 = (r0 + ROW_BLOCK < end) ? r0 + ROW_BLOCK : end;
+		for (qi = 0; qi < nq; qi += QUERY_BLOCK) {
+			for (r = r0; r < r1; r += 2) {
+				vec.tile(vec.M + r * vec.stride, Q + qi * vec.stride, vec.stride, s);
+				for (j = 0; j < 2 * QUERY_BLOCK; j++) {
+					if (qi + j % QUERY_BLOCK >= nq) continue;
+					hs = heap_score + ((long long)id * batch + qi + j % QUERY_BLOCK) * top;
+					// most scores lose against the smallest candidate, the rest is rare
+					if (s[j] <= hs[0]) continue;
+					w = r + j / QUERY_BLOCK;
+					if ((w >= vec.words) || InQuery(&qs[qi + j % QUERY_BLOCK], w)) continue;
+					hw = heap_word + ((long long)id * batch + qi + j % QUERY_BLOCK) * top;
+					HeapReplace(hs, hw, top, s[j], w);
+				}
+			}
+		}
+	}
+	pthread_exit(NULL);
+}
+
+// the query vector of line q (the sum of the vectors of its words, normalized),
+// returns 0 if a word is not in the vectors
+int ParseQuery(long long q, int verbose) {
+	char word[MAX_QUERY], * p = qs[q].text;
+	real * v = Q + q * vec.stride, len = 0;
+	long long a, b, n;
+	qs[q].n = 0;
+	memset(v, 0, vec.stride * sizeof(real));
+	while (sscanf(p, "%s%lln", word, &n) == 1) {
+		p += n;
+		if (qs[q].n == MAX_QUERY_WORDS) break;
+		a = SearchWord(&vec, word);
+		if (verbose) printf("\nWord: %s  Position in vocabulary: %lld\n", word, a);
+		if (a == -1) {
+			if (verbose) printf("Out of dictionary word!\n");
+			else fprintf(stderr, "Out of dictionary word %s in: %s\n", word, qs[q].text);
+			return 0;
+		}
+		qs[q].word[qs[q].n++] = a;
+		for (b = 0; b < vec.size; b++) v[b] += vec.M[a * vec.stride + b];
+	}
+	if (qs[q].n == 0) return 0;
+	for (b = 0; b < vec.size; b++) len += v[b] * v[b];
+	len = sqrt(len);
+	if (len > 0) for (b = 0; b < vec.size; b++) v[b] /= len;
+	return 1;
+}
+
+// a result, best holds top of them per query, best first
+struct candidate {
+	real score;
+	long long word;
+};
+
+int CompareCandidates(const void * a, const void * b) {
+	real d = ((struct candidate *)b)->score - ((struct candidate *)a)->score;
+	return (d > 0) - (d < 0);
+}
+
+void ReadIndex() {
+	// -ef: the graph of the same vectors, <FILE>.hnsw
+	char name[MAX_STRING + 8];
+	unsigned long long checksum = HNSW_CHECKSUM_INIT;
+	long long a;
+	int err;
+	sprintf(name, "%s.hnsw", file_name);
+	for (a = 0; a < vec.words; a++) checksum = HnswChecksum(checksum, VectorsWord(&vec, a));
+	memset(&graph, 0, sizeof(graph));
+	graph.n = vec.words;
+	graph.size = vec.size;
+	graph.stride = vec.stride;
+	graph.data = vec.M;
+	graph.dot = vec.dot;
+	err = HnswLoad(&graph, name, checksum);
+	if (err == -1) printf("ERROR: index file %s not found (word2vec -hnsw builds it)\n", name);
+	if (err == -2) printf("ERROR: %s is not an index file\n", name);
+	if (err == -3) printf("ERROR: %s was built for other vectors\n", name);
+	if (err != 0) exit(1);
+	searches = (struct hnsw_search *)malloc(num_threads * sizeof(struct hnsw_search));
+	for (a = 0; a < num_threads; a++) HnswSearchInit(&graph, &searches[a], (ef > top + MAX_QUERY_WORDS) ? ef : top + MAX_QUERY_WORDS);
+}
+
+struct candidate * found;
+
+void *IndexThread(void *id) {
+	// every num_threads-th query of the batch, the query words are searched for too and dropped
+	long long q, i;
+	int * ids = (int *)malloc((top + MAX_QUERY_WORDS) * sizeof(int)), n, k;
+	real * sims = (real *)malloc((top + MAX_QUERY_WORDS) * sizeof(real));
+	for (q = (long long)id; q < nq; q += num_threads) {
+		n = HnswSearch(&graph, &searches[(long long)id], Q + q * vec.stride, top + qs[q].n, ef, ids, sims);
+		for (i = 0, k = 0; (i < n) && (k < top); i++) if (!InQuery(&qs[q], ids[i])) {
+			found[q * top + k].score = sims[i];
+			found[q * top + k++].word = ids[i];
+		}
+		for (; k < top; k++) found[q * top + k].word = -1;
+	}
+	free(ids);
+	free(sims);
+	pthread_exit(NULL);
+}
+
+void Search(struct candidate * best) {
+	long long a, q, i;
+	pthread_t * pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+	real * hs;
+	long long * hw;
+	if (ef > 0) {
+		found = best;
+		for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, IndexThread, (void *)a);
+		for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+		free(pt);
+		return;
+	}
+	// the kernels read QUERY_BLOCK queries at a time, the rows past nq are zero
+	memset(Q + nq * vec.stride, 0, ((nq + QUERY_BLOCK - 1) / QUERY_BLOCK * QUERY_BLOCK - nq) * vec.stride * sizeof(real));
+	for (a = 0; a < (long long)num_threads * batch * top; a++) {
+		heap_score[a] = -2; // below any cosine
+		heap_word[a] = -1;
+	}
+	for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, SearchThread, (void *)a);
+	for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+	free(pt);
+	// the top of all the threads' candidates
+	for (q = 0; q < nq; q++) {
+		hs = heap_score + q * top;
+		hw = heap_word + q * top;
+		for (a = 1; a < num_threads; a++) for (i = 0; i < top; i++) {
+			real s = heap_score[(a * batch + q) * top + i];
+			if (s > hs[0]) HeapReplace(hs, hw, top, s, heap_word[(a * batch + q) * top + i]);
+		}
+		for (i = 0; i < top; i++) {
+			best[q * top + i].score = hs[i];
+			best[q * top + i].word = hw[i];
+		}
+		qsort(best + q * top, top, sizeof(struct candidate), CompareCandidates);
+	}
+}
+
+void Interactive() {
+	// the prompt and the table of the original distance
+	struct candidate * best = (struct candidate *)malloc(top * sizeof(struct candidate));
+	long long a;
+	while (1) {
+		printf("Enter word or sentence (EXIT to break): ");
+		fflush(stdout);
+		if (fgets(qs[0].text, MAX_QUERY, stdin) == NULL) break;
+		qs[0].text[strcspn(qs[0].text, "\r\n")] = 0;
+		if (!strcmp(qs[0].text, "EXIT")) break;
+		if (!ParseQuery(0, 1)) continue;
+		nq = 1;
+		Search(best);
+		printf("\n                                              Word       Cosine distance\n------------------------------------------------------------------------\n");
+		for (a = 0; a < top; a++) if (best[a].word != -1)
+			printf("%50s\t\t%f\n", VectorsWord(&vec, best[a].word), best[a].score);
+	}
+	free(best);
+}
+
+void Batches() {
+	// batch lines at a time from -queries (or stdin), the results as tab separated lines
+	struct candidate * best = (struct candidate *)malloc((long long)batch * top * sizeof(struct candidate));
+	long long a, q, total = 0;
+	struct timespec t0, t1;
+	FILE * fin = stdin;
+	if (queries_file[0] != 0) fin = fopen(queries_file, "rb");
+	if (fin == NULL) {
+		printf("ERROR: query file not found!\n");
+		exit(1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while (1) {
+		nq = 0;
+		while ((nq < batch) && (fgets(qs[nq].text, MAX_QUERY, fin) != NULL)) {
+			qs[nq].text[strcspn(qs[nq].text, "\r\n")] = 0;
+			if (ParseQuery(nq, 0)) nq++;
+		}
+		if (nq == 0) break;
+		Search(best);
+		for (q = 0; q < nq; q++) for (a = 0; a < top; a++) if (best[q * top + a].word != -1)
+			printf("%s\t%s\t%f\n", qs[q].text, VectorsWord(&vec, best[q * top + a].word), best[q * top + a].score);
+		total += nq;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (debug_mode > 0) {
+		real secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+		fprintf(stderr, "%lld queries in %.2fs, %.0f queries/s\n", total, secs, total / (secs > 0 ? secs : 1));
+	}
+	if (fin != stdin) fclose(fin);
+	free(best);
+}
+
+int ArgPos(char *str, int argc, char **argv) {
+	int a;
+	for (a = 1; a < argc; a++) if (!strcmp(str, argv[a])) {
+		if (a == argc - 1) {
+			printf("Argument missing for %s\n", str);
+			exit(1);
+		}
+		return a;
+	}
+	return -1;
+}
+
+int main(int argc, char **argv) {
+	int i;
+	char * name;
+	if (argc < 2) {
+		printf("Usage: ./distance <FILE> [options]\nwhere FILE contains word projections in any of the formats of word2vec -binary\n\n");
+		printf("Options:\n");
+		printf("\t-top <int>\n");
+		printf("\t\tNumber of closest words to show; default is 40\n");
+		printf("\t-queries <file>\n");
+		printf("\t\tRead the queries, one word or sentence per line, from <file>; default is stdin\n");
+		printf("\t-batch <int>\n");
+		printf("\t\tNumber of queries searched together; default is 256\n");
+		printf("\t-ef <int>\n");
+		printf("\t\tSearch the HNSW index <FILE>.hnsw (word2vec -hnsw) keeping <int> candidates, more is slower and closer to exact; default is 0 (exact search of all the vectors)\n");
+		printf("\t-threads <int>\n");
+		printf("\t\tUse <int> threads; default is the number of cpus\n");
+		printf("\t-debug <int>\n");
+		printf("\t\tSet the debug mode (default = 1 = the query rate of a batch run on stderr)\n");
+		printf("\nWith a terminal on stdin and no -queries, the words are asked for interactively;\n");
+		printf("otherwise every result is printed as: query<TAB>word<TAB>cosine\n");
+		printf("\nExamples:\n");
+		printf("./distance vectors.bin\n");
+		printf("./distance vectors.bin -queries words.txt -top 10 > neighbours.tsv\n");
+		printf("./distance vectors.bin -queries words.txt -top 10 -ef 100 > neighbours.tsv\n\n");
+		return 0;
+	}
+	strcpy(file_name, argv[1]);
+	queries_file[0] = 0;
+	if ((i = ArgPos((char *)"-top", argc, argv)) > 0) top = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *)"-queries", argc, argv)) > 0) strcpy(queries_file, argv[i + 1]);
+	if ((i = ArgPos((char *)"-batch", argc, argv)) > 0) batch = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *)"-debug", argc, argv)) > 0) debug_mode = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *)"-ef", argc, argv)) > 0) ef = atoi(argv[i + 1]);
+	if (num_threads < 1) num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if ((top < 1) || (batch < 1)) {
+		printf("ERROR: -top and -batch must be positive\n");
+		return 1;
+	}
+	name = InitVectorKernels(&vec);
+	if (debug_mode > 1) fprintf(stderr, "Using %s kernels\n", name);
+	ReadVectors(&vec, file_name, 0, num_threads);
+	if (top > vec.words) top = vec.words;
+	if (ef > 0) ReadIndex();
+	qs = (struct query *)malloc(batch * sizeof(struct query));
+	if (posix_memalign((void **)&Q, 64, (batch + QUERY_BLOCK) * vec.stride * sizeof(real))) Q = NULL;
+	heap_score = (real *)malloc((long long)num_threads * batch * top * sizeof(real));
+	heap_word = (long long *)malloc((long long)num_threads * batch * top * sizeof(long long));
+	if ((qs == NULL) || (Q == NULL) || (heap_score == NULL) || (heap_word == NULL)) {
+		printf("Memory allocation failed\n");
+		return 1;
+	}
+	if ((queries_file[0] == 0) && isatty(0)) Interactive(); else Batches();
+	return 0;
+}
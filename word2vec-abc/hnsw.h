@@ -0,0 +1,499 @@
+//  HNSW - a hierarchical navigable small world graph over normalized word vectors,
+//  for approximate nearest neighbour search by cosine (Malkov & Yashunin, 2016).
+//  word2vec builds it after training (-hnsw) and distance searches it (-ef).
+//  Every node gets a random level (P(level >= l) = m^-l); at each of its levels it is
+//  linked to up to m nodes (2 * m at level 0), picked by the neighbour heuristic.
+//  A search walks greedily down from the entry point (the node of the highest level)
+//  and keeps the best ef candidates at level 0 - more ef, better recall, slower.
+//  The nodes are inserted in parallel, each one locks only the link lists it writes.
+//  The index file <vectors>.hnsw holds the graph, the vectors stay in their file:
+//  * struct hnsw_header
+//  * level - an int per node
+//  * links0 - node x (2 * m + 1) ints for level 0, the count then the links
+//  * upper - for the nodes with level > 0 in order, level x (m + 1) ints for 1..level
+//  * samples - HNSW_SAMPLES rows (fewer if there are fewer nodes) of the vectors the
+//    graph was built for, size floats each, see HnswSampleRow
+//  All the numbers are in the byte order of the machine that wrote the file.
+
+#ifndef HNSW_H
+#define HNSW_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define HNSW_MAGIC "W2VHNSW"
+#define HNSW_MAX_LEVEL 30
+#define HNSW_MAX_M 65536
+// rows of the vectors kept in the index, a load compares them (by cosine, the text
+// formats may round) with the vectors it gets, to refuse a graph of older vectors
+#define HNSW_SAMPLES 16
+#define HNSW_SAMPLE_COSINE 0.99
+#define HNSW_CHECKSUM_INIT 14695981039346656037ULL
+
+struct hnsw_header {
+	char magic[8]; // HNSW_MAGIC
+	long long words;
+	long long size;
+	unsigned long long checksum; // HnswChecksum of the words, in order
+	long long m;
+	long long max_level;
+	long long entry;
+	long long upper_links; // ints in upper
+};
+
+struct hnsw {
+	long long n, size, stride;
+	float * data; // n rows stride floats apart, normalized
+	float (*dot)(float * a, void * b, long long n);
+	int m, max_level, entry;
+	int * level;
+	int * links0;
+	long long * upper_offset; // of the links of each node in upper
+	int * upper;
+	long long upper_links;
+	// during the build only - a spin lock per node, and the entry point lock
+	unsigned char * lock;
+	pthread_mutex_t global;
+	int ef_construction;
+	long long next;
+};
+
+// the working memory of one searching thread
+// * visited - visited[a] == tag if node a was seen by the current search
+// * cand - min heap of -similarity, the nodes still to expand, best first
+// * res - min heap of similarity, the best ef so far, worst first
+// * nb, sel, tmp_id, tmp_sim - link lists and candidates being sorted out
+struct hnsw_search {
+	unsigned int * visited, tag;
+	float * cand_sim, * res_sim, * tmp_sim;
+	int * cand, * res, * nb, * sel, * tmp_id;
+	long long cand_cap, nres;
+};
+
+// FNV-1a over the words, so that an index is never used with another vocabulary
+// (the vectors of the same vocabulary are told apart by the samples, see HnswLoad)
+static inline unsigned long long HnswChecksum(unsigned long long h, char * word) {
+	do {
+		h ^= (unsigned char)*word;
+		h *= 1099511628211ULL;
+	} while (*word++);
+	return h;
+}
+
+static inline float * HnswRow(struct hnsw * h, long long a) {
+	return h->data + a * h->stride;
+}
+
+// the links of node a at level l, [0] is the count
+static inline int * HnswLinks(struct hnsw * h, long long a, int l) {
+	if (l == 0) return h->links0 + a * (2 * h->m + 1);
+	return h->upper + h->upper_offset[a] + (l - 1) * (h->m + 1);
+}
+
+static inline void HnswLock(struct hnsw * h, long long a) {
+	if (h->lock == NULL) return;
+	while (__atomic_test_and_set(&h->lock[a], __ATOMIC_ACQUIRE)) sched_yield();
+}
+
+static inline void HnswUnlock(struct hnsw * h, long long a) {
+	if (h->lock != NULL) __atomic_clear(&h->lock[a], __ATOMIC_RELEASE);
+}
+
+// copies the links of a at level l to nb, returns their count
+static inline int HnswCopyLinks(struct hnsw * h, long long a, int l, int * nb) {
+	int * links = HnswLinks(h, a, l), n;
+	HnswLock(h, a);
+	n = links[0];
+	memcpy(nb, links + 1, n * sizeof(int));
+	HnswUnlock(h, a);
+	return n;
+}
+
+static inline void HnswPush(float * key, int * id, long long * n, float k, int v) {
+	long long i = (*n)++, p;
+	while ((i > 0) && (key[p = (i - 1) / 2] > k)) {
+		key[i] = key[p];
+		id[i] = id[p];
+		i = p;
+	}
+	key[i] = k;
+	id[i] = v;
+}
+
+// removes the smallest
+static inline void HnswPop(float * key, int * id, long long * n) {
+	long long i = 0, c, last = --(*n);
+	float k = key[last];
+	int v = id[last];
+	while ((c = 2 * i + 1) < *n) {
+		if ((c + 1 < *n) && (key[c + 1] < key[c])) c++;
+		if (k <= key[c]) break;
+		key[i] = key[c];
+		id[i] = id[c];
+		i = c;
+	}
+	key[i] = k;
+	id[i] = v;
+}
+
+static inline void HnswSearchInit(struct hnsw * h, struct hnsw_search * s, int max_ef) {
+	s->visited = (unsigned int *)calloc(h->n, sizeof(unsigned int));
+	s->tag = 0;
+	s->cand_cap = 1024;
+	s->cand_sim = (float *)malloc(s->cand_cap * sizeof(float));
+	s->cand = (int *)malloc(s->cand_cap * sizeof(int));
+	s->res_sim = (float *)malloc((max_ef + 1) * sizeof(float));
+	s->res = (int *)malloc((max_ef + 1) * sizeof(int));
+	s->tmp_sim = (float *)malloc((max_ef + 2 * h->m + 1) * sizeof(float));
+	s->tmp_id = (int *)malloc((max_ef + 2 * h->m + 1) * sizeof(int));
+	s->nb = (int *)malloc((2 * h->m + 1) * sizeof(int));
+	s->sel = (int *)malloc((2 * h->m + 1) * sizeof(int));
+	if ((s->visited == NULL) || (s->cand == NULL) || (s->tmp_id == NULL) || (s->sel == NULL)) {
+		printf("Memory allocation failed\n");
+		exit(1);
+	}
+}
+
+static inline void HnswSearchFree(struct hnsw_search * s) {
+	free(s->visited);
+	free(s->cand_sim);
+	free(s->cand);
+	free(s->res_sim);
+	free(s->res);
+	free(s->tmp_sim);
+	free(s->tmp_id);
+	free(s->nb);
+	free(s->sel);
+}
+
+// the node closest to q at level l, starting from ep
+static inline int HnswGreedy(struct hnsw * h, struct hnsw_search * s, float * q, int ep, int l) {
+	float best = h->dot(q, HnswRow(h, ep), h->size), sim;
+	int changed = 1, n, a;
+	while (changed) {
+		changed = 0;
+		n = HnswCopyLinks(h, ep, l, s->nb);
+		for (a = 0; a < n; a++) {
+			sim = h->dot(q, HnswRow(h, s->nb[a]), h->size);
+			if (sim > best) {
+				best = sim;
+				ep = s->nb[a];
+				changed = 1;
+			}
+		}
+	}
+	return ep;
+}
+
+// the best ef nodes to q at level l into s->res, starting from ep
+static inline void HnswSearchLayer(struct hnsw * h, struct hnsw_search * s, float * q, int ep, int ef, int l) {
+	long long nc = 0;
+	float sim;
+	int c, e, n, a;
+	if (++s->tag == 0) {
+		memset(s->visited, 0, h->n * sizeof(unsigned int));
+		s->tag = 1;
+	}
+	s->nres = 0;
+	sim = h->dot(q, HnswRow(h, ep), h->size);
+	s->visited[ep] = s->tag;
+	HnswPush(s->cand_sim, s->cand, &nc, -sim, ep);
+	HnswPush(s->res_sim, s->res, &s->nres, sim, ep);
+	while (nc > 0) {
+		// the best candidate left is worse than the worst result - done
+		if ((-s->cand_sim[0] < s->res_sim[0]) && (s->nres >= ef)) break;
+		c = s->cand[0];
+		HnswPop(s->cand_sim, s->cand, &nc);
+		n = HnswCopyLinks(h, c, l, s->nb);
+		for (a = 0; a < n; a++) {
+			e = s->nb[a];
+			if (s->visited[e] == s->tag) continue;
+			s->visited[e] = s->tag;
+			sim = h->dot(q, HnswRow(h, e), h->size);
+			if ((s->nres < ef) || (sim > s->res_sim[0])) {
+				if (nc == s->cand_cap) {
+					s->cand_cap *= 2;
+					s->cand_sim = (float *)realloc(s->cand_sim, s->cand_cap * sizeof(float));
+					s->cand = (int *)realloc(s->cand, s->cand_cap * sizeof(int));
+					if ((s->cand_sim == NULL) || (s->cand == NULL)) {
+						printf("Memory allocation failed\n");
+						exit(1);
+					}
+				}
+				HnswPush(s->cand_sim, s->cand, &nc, -sim, e);
+				HnswPush(s->res_sim, s->res, &s->nres, sim, e);
+				if (s->nres > ef) HnswPop(s->res_sim, s->res, &s->nres);
+			}
+		}
+	}
+}
+
+// empties s->res into id / sim, best first, returns the count
+static inline int HnswTakeResults(struct hnsw_search * s, int * id, float * sim) {
+	int n = s->nres, a;
+	for (a = n - 1; a >= 0; a--) {
+		id[a] = s->res[0];
+		sim[a] = s->res_sim[0];
+		HnswPop(s->res_sim, s->res, &s->nres);
+	}
+	return n;
+}
+
+// the neighbour heuristic - of the candidates (best first by similarity to the
+// node), keeps one only if it is closer to the node than to all the kept ones,
+// so that the links point in different directions; returns the count
+static inline int HnswSelect(struct hnsw * h, int * id, float * sim, int n, int m, int * out) {
+	int a, b, k = 0;
+	for (a = 0; (a < n) && (k < m); a++) {
+		for (b = 0; b < k; b++)
+			if (h->dot(HnswRow(h, id[a]), HnswRow(h, out[b]), h->size) > sim[a]) break;
+		if (b == k) out[k++] = id[a];
+	}
+	return k;
+}
+
+// adds the link e -> q at level l, thinning the links of e if they are full
+static inline void HnswLinkBack(struct hnsw * h, struct hnsw_search * s, int e, int q, int l) {
+	int cap = l ? h->m : 2 * h->m, * links = HnswLinks(h, e, l), n, a, b, id;
+	float sim;
+	HnswLock(h, e);
+	if (links[0] < cap) links[1 + links[0]++] = q;
+	else {
+		// the old links and q, sorted by similarity to e (insertion sort, n <= 2 * m + 1)
+		n = links[0];
+		for (a = 0; a <= n; a++) {
+			id = (a < n) ? links[1 + a] : q;
+			sim = h->dot(HnswRow(h, e), HnswRow(h, id), h->size);
+			for (b = a; (b > 0) && (s->tmp_sim[b - 1] < sim); b--) {
+				s->tmp_sim[b] = s->tmp_sim[b - 1];
+				s->tmp_id[b] = s->tmp_id[b - 1];
+			}
+			s->tmp_sim[b] = sim;
+			s->tmp_id[b] = id;
+		}
+		links[0] = HnswSelect(h, s->tmp_id, s->tmp_sim, n + 1, cap, links + 1);
+	}
+	HnswUnlock(h, e);
+}
+
+static inline void HnswInsert(struct hnsw * h, struct hnsw_search * s, int q) {
+	float * v = HnswRow(h, q);
+	int top, ep, l, n, k, a, * links;
+	// a node above the top level becomes the entry point, it holds the global
+	// lock until then so that no other node does the same meanwhile
+	pthread_mutex_lock(&h->global);
+	top = h->max_level;
+	ep = h->entry;
+	if (h->level[q] <= top) pthread_mutex_unlock(&h->global);
+	for (l = top; l > h->level[q]; l--) ep = HnswGreedy(h, s, v, ep, l);
+	for (l = (h->level[q] < top) ? h->level[q] : top; l >= 0; l--) {
+		HnswSearchLayer(h, s, v, ep, h->ef_construction, l);
+		n = HnswTakeResults(s, s->tmp_id, s->tmp_sim);
+		ep = s->tmp_id[0];
+		k = HnswSelect(h, s->tmp_id, s->tmp_sim, n, h->m, s->sel);
+		links = HnswLinks(h, q, l);
+		HnswLock(h, q);
+		memcpy(links + 1, s->sel, k * sizeof(int));
+		links[0] = k;
+		HnswUnlock(h, q);
+		for (a = 0; a < k; a++) HnswLinkBack(h, s, s->sel[a], q, l);
+	}
+	if (h->level[q] > top) {
+		h->entry = q;
+		h->max_level = h->level[q];
+		pthread_mutex_unlock(&h->global);
+	}
+}
+
+static inline void * HnswBuildThread(void * arg) {
+	struct hnsw * h = (struct hnsw *)arg;
+	struct hnsw_search s;
+	long long a;
+	HnswSearchInit(h, &s, h->ef_construction);
+	while ((a = __atomic_fetch_add(&h->next, 1, __ATOMIC_RELAXED)) < h->n) HnswInsert(h, &s, a);
+	HnswSearchFree(&s);
+	return NULL;
+}
+
+// allocates the link lists, upper_offset from level
+static inline void HnswAlloc(struct hnsw * h) {
+	long long a;
+	h->upper_offset = (long long *)malloc(h->n * sizeof(long long));
+	h->links0 = (int *)calloc(h->n * (2 * h->m + 1), sizeof(int));
+	if ((h->upper_offset == NULL) || (h->links0 == NULL)) {
+		printf("Memory allocation failed\n");
+		exit(1);
+	}
+	h->upper_links = 0;
+	for (a = 0; a < h->n; a++) {
+		h->upper_offset[a] = h->upper_links;
+		h->upper_links += h->level[a] * (h->m + 1);
+	}
+	h->upper = (int *)calloc(h->upper_links + 1, sizeof(int));
+	if (h->upper == NULL) {
+		printf("Memory allocation failed\n");
+		exit(1);
+	}
+}
+
+// builds the graph of the n rows of data (normalized) with num_threads threads
+static inline void HnswBuild(struct hnsw * h, int m, int ef_construction, int num_threads) {
+	pthread_t * pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+	unsigned long long r;
+	double mult = 1 / log(m), u;
+	long long a;
+	h->m = m;
+	h->ef_construction = (ef_construction > m) ? ef_construction : m;
+	h->level = (int *)malloc(h->n * sizeof(int));
+	h->lock = (unsigned char *)calloc(h->n, 1);
+	if ((h->level == NULL) || (h->lock == NULL)) {
+		printf("Memory allocation failed\n");
+		exit(1);
+	}
+	// the levels come from a hash of the node, so the same vectors get the same levels
+	for (a = 0; a < h->n; a++) {
+		r = (a + 1) * 0x9E3779B97F4A7C15ULL;
+		r = (r ^ (r >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		r = (r ^ (r >> 27)) * 0x94D049BB133111EBULL;
+		r ^= r >> 31;
+		u = ((r >> 11) + 0.5) / (double)(1ULL << 53);
+		h->level[a] = (int)(-log(u) * mult);
+		if (h->level[a] > HNSW_MAX_LEVEL) h->level[a] = HNSW_MAX_LEVEL;
+	}
+	HnswAlloc(h);
+	pthread_mutex_init(&h->global, NULL);
+	h->entry = 0;
+	h->max_level = h->level[0];
+	h->next = 1;
+	for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, HnswBuildThread, (void *)h);
+	for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+	pthread_mutex_destroy(&h->global);
+	free(h->lock);
+	h->lock = NULL;
+	free(pt);
+}
+
+// the k nearest rows to q (normalized) into id / sim, best first, returns the count
+static inline int HnswSearch(struct hnsw * h, struct hnsw_search * s, float * q, int k, int ef, int * id, float * sim) {
+	int ep = h->entry, l;
+	for (l = h->max_level; l > 0; l--) ep = HnswGreedy(h, s, q, ep, l);
+	HnswSearchLayer(h, s, q, ep, (ef > k) ? ef : k, 0);
+	while (s->nres > k) HnswPop(s->res_sim, s->res, &s->nres);
+	return HnswTakeResults(s, id, sim);
+}
+
+// the row of sample s, of HnswSamples(h) evenly spread over the nodes
+static inline long long HnswSamples(struct hnsw * h) {
+	return (h->n < HNSW_SAMPLES) ? h->n : HNSW_SAMPLES;
+}
+
+static inline long long HnswSampleRow(struct hnsw * h, long long s) {
+	return s * h->n / HnswSamples(h);
+}
+
+// returns 0 if it worked, -1 if the file cannot be written
+static inline int HnswSave(struct hnsw * h, char * name, unsigned long long checksum) {
+	struct hnsw_header hd;
+	long long s;
+	int ok;
+	FILE * fo = fopen(name, "wb");
+	if (fo == NULL) return -1;
+	memset(&hd, 0, sizeof(hd));
+	strcpy(hd.magic, HNSW_MAGIC);
+	hd.words = h->n;
+	hd.size = h->size;
+	hd.checksum = checksum;
+	hd.m = h->m;
+	hd.max_level = h->max_level;
+	hd.entry = h->entry;
+	hd.upper_links = h->upper_links;
+	ok = (fwrite(&hd, sizeof(hd), 1, fo) == 1);
+	ok = ok && (fwrite(h->level, sizeof(int), h->n, fo) == h->n);
+	ok = ok && (fwrite(h->links0, sizeof(int), h->n * (2 * h->m + 1), fo) == h->n * (2 * h->m + 1));
+	ok = ok && (fwrite(h->upper, sizeof(int), h->upper_links, fo) == h->upper_links);
+	for (s = 0; s < HnswSamples(h); s++) ok = ok && (fwrite(HnswRow(h, HnswSampleRow(h, s)), sizeof(float), h->size, fo) == h->size);
+	if (fclose(fo) != 0) ok = 0;
+	return ok ? 0 : -1;
+}
+
+// checks what a load read before it is used: the levels, and every link below n
+static inline int HnswValid(struct hnsw * h) {
+	long long a, b;
+	int l, * links;
+	for (a = 0; a < h->n; a++) {
+		for (l = 0; l <= h->level[a]; l++) {
+			links = HnswLinks(h, a, l);
+			if ((links[0] < 0) || (links[0] > ((l == 0) ? 2 * h->m : h->m))) return 0;
+			for (b = 1; b <= links[0]; b++) if ((links[b] < 0) || (links[b] >= h->n)) return 0;
+		}
+	}
+	return 1;
+}
+
+// reads the graph of the vectors already in h (n, size, stride, data, dot), returns
+// 0 if it worked, -1 if the file cannot be opened, -2 if it is not a (complete, sound)
+// index and -3 if it was built for other vectors
+static inline int HnswLoad(struct hnsw * h, char * name, unsigned long long checksum) {
+	struct hnsw_header hd;
+	float * sample, * row, dot, len;
+	long long a, s;
+	int ok, same = 1;
+	FILE * fin = fopen(name, "rb");
+	if (fin == NULL) return -1;
+	if ((fread(&hd, sizeof(hd), 1, fin) != 1) || memcmp(hd.magic, HNSW_MAGIC, 8)) {
+		fclose(fin);
+		return -2;
+	}
+	if ((hd.words != h->n) || (hd.size != h->size) || (hd.checksum != checksum)) {
+		fclose(fin);
+		return -3;
+	}
+	if ((hd.m < 1) || (hd.m > HNSW_MAX_M) || (hd.max_level < 0) || (hd.max_level > HNSW_MAX_LEVEL) ||
+		(hd.entry < 0) || (hd.entry >= h->n)) {
+		fclose(fin);
+		return -2;
+	}
+	h->m = hd.m;
+	h->max_level = hd.max_level;
+	h->entry = hd.entry;
+	h->lock = NULL;
+	h->level = (int *)malloc(h->n * sizeof(int));
+	sample = (float *)malloc(h->size * sizeof(float));
+	if ((h->level == NULL) || (sample == NULL)) {
+		printf("Memory allocation failed\n");
+		exit(1);
+	}
+	ok = (fread(h->level, sizeof(int), h->n, fin) == h->n);
+	for (a = 0; ok && (a < h->n); a++) ok = (h->level[a] >= 0) && (h->level[a] <= h->max_level);
+	ok = ok && (h->level[h->entry] == h->max_level);
+	if (ok) {
+		HnswAlloc(h);
+		ok = (h->upper_links == hd.upper_links);
+	}
+	ok = ok && (fread(h->links0, sizeof(int), h->n * (2 * h->m + 1), fin) == h->n * (2 * h->m + 1));
+	ok = ok && (fread(h->upper, sizeof(int), h->upper_links, fin) == h->upper_links);
+	ok = ok && HnswValid(h);
+	for (s = 0; ok && (s < HnswSamples(h)); s++) {
+		ok = (fread(sample, sizeof(float), h->size, fin) == h->size);
+		row = HnswRow(h, HnswSampleRow(h, s));
+		dot = 0;
+		len = 0;
+		for (a = 0; a < h->size; a++) {
+			dot += sample[a] * row[a];
+			len += sample[a] * sample[a];
+		}
+		// a zero vector is only the same as a zero vector
+		if (len == 0) same = same && (h->dot(row, row, h->size) == 0);
+		else same = same && (dot >= HNSW_SAMPLE_COSINE * sqrt(len));
+	}
+	fclose(fin);
+	free(sample);
+	if (!ok) return -2;
+	return same ? 0 : -3;
+}
+
+#endif
@@ -0,0 +1,111 @@
+//  The -binary 2 model format of word2vec - a file that can be mapped and used
+//  as it is, without parsing:
+//  * struct model_header
+//  * the vectors, row a is the vector of word a, the matrix starts at a MODEL_ALIGN
+//    aligned offset (the rows are layer1_size floats apart, not aligned themselves)
+//  * index - vocab_size + 1 offsets of the words in the strings (the last one is the end),
+//    at a MODEL_ALIGN aligned offset after the zero padding of the matrix
+//  * strings - the words in vocab order, each 0 terminated, at a MODEL_ALIGN
+//    aligned offset after the zero padding of the index
+//  All the numbers are in the byte order of the machine that wrote the file.
+
+#ifndef MODEL_H
+#define MODEL_H
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MODEL_MAGIC "W2VMOD1"
+#define MODEL_ALIGN 64
+
+// dtype of the vectors
+#define MODEL_FLOAT32 0
+
+struct model_header {
+	char magic[8]; // MODEL_MAGIC
+	long long vocab_size;
+	long long layer1_size;
+	long long dtype;
+	long long matrix_offset; // from the start of the file
+	long long index_offset;
+	long long strings_offset;
+	long long file_size; // of the whole file, to catch truncated copies
+};
+
+// a mapped model file
+struct model {
+	struct model_header * h;
+	void * matrix; // float * for MODEL_FLOAT32
+	long long * index;
+	char * strings;
+	long long size; // of the mapping
+};
+
+// word a of a mapped model
+static inline char * ModelWord(struct model * md, long long a) {
+	return md->strings + md->index[a];
+}
+
+// the header and the index fit in the size bytes of the file, 0 if they do not
+static inline int ModelValid(struct model_header * h, char * data, long long size) {
+	long long a, * index;
+	if ((h->vocab_size < 0) || (h->layer1_size < 1) || (h->vocab_size > size / 8)) return 0;
+	if ((h->vocab_size > 0) && (h->layer1_size > size / 4 / h->vocab_size)) return 0;
+	// the three parts start where SaveModel puts them, the readers rely on the alignment
+	if ((h->matrix_offset % MODEL_ALIGN) || (h->index_offset % MODEL_ALIGN) || (h->strings_offset % MODEL_ALIGN)) return 0;
+	if ((h->matrix_offset < (long long)sizeof(struct model_header)) || (h->matrix_offset > size)) return 0;
+	if (h->matrix_offset + h->vocab_size * h->layer1_size * 4 > h->index_offset) return 0;
+	if ((h->index_offset > size) || (h->index_offset + (h->vocab_size + 1) * 8 > h->strings_offset)) return 0;
+	if (h->strings_offset > size) return 0;
+	index = (long long *)(data + h->index_offset);
+	if ((index[0] != 0) || (index[h->vocab_size] > size - h->strings_offset)) return 0;
+	// every word starts after the one before and ends with its 0
+	for (a = 0; a < h->vocab_size; a++) {
+		if (index[a + 1] <= index[a]) return 0;
+		if (data[h->strings_offset + index[a + 1] - 1] != 0) return 0;
+	}
+	return 1;
+}
+
+// Maps a model file, returns 0 if it worked, -1 if the file cannot be opened
+// and -2 if it is not a (complete, sound) model file
+static inline int MapModel(char * name, struct model * md) {
+	struct stat st;
+	char * data;
+	struct model_header * h;
+	int fd = open(name, O_RDONLY);
+	if (fd == -1) return -1;
+	fstat(fd, &st);
+	if (st.st_size < (long long)sizeof(struct model_header)) {
+		close(fd);
+		return -2;
+	}
+	data = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) return -1;
+	h = (struct model_header *)data;
+	if (memcmp(h->magic, MODEL_MAGIC, 8) || (h->file_size != st.st_size) || !ModelValid(h, data, st.st_size)) {
+		munmap(data, st.st_size);
+		return -2;
+	}
+	md->h = h;
+	md->matrix = data + h->matrix_offset;
+	md->index = (long long *)(data + h->index_offset);
+	md->strings = data + h->strings_offset;
+	md->size = st.st_size;
+	return 0;
+}
+
+static inline int IsModelFile(char * name) {
+	char magic[8];
+	int fd = open(name, O_RDONLY), ok;
+	if (fd == -1) return 0;
+	ok = (read(fd, magic, 8) == 8) && !memcmp(magic, MODEL_MAGIC, 8);
+	close(fd);
+	return ok;
+}
+
+#endif
@@ -0,0 +1,109 @@
+//  The kernels of the blocked matrix products - a 2 x 4 tile, the dot products of
+//  2 rows of m with 4 rows of q, s[i * 4 + j] = dot(m row i, q row j).
+//  All rows are stride floats apart, stride a multiple of 16 (64 bytes) and the rows
+//  padded with zeros, so that the kernels never need a tail.
+//  Used by the query tools (vectors.h), by word2vec -batch-negative and by the
+//  k-means of word2vec -classes.
+
+#ifndef TILE_H
+#define TILE_H
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+static inline void TileScalar(float * m, float * q, long long stride, float * s) {
+	long long c;
+	int i, j;
+	for (i = 0; i < 2; i++) for (j = 0; j < 4; j++) {
+		float f = 0;
+		for (c = 0; c < stride; c++) f += m[i * stride + c] * q[j * stride + c];
+		s[i * 4 + j] = f;
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// the horizontal sums of 8 vectors, in one vector
+__attribute__((target("avx2")))
+static inline __m256 Sum8x8(__m256 a0, __m256 a1, __m256 a2, __m256 a3,
+		__m256 a4, __m256 a5, __m256 a6, __m256 a7) {
+	__m256 t0 = _mm256_hadd_ps(_mm256_hadd_ps(a0, a1), _mm256_hadd_ps(a2, a3));
+	__m256 t1 = _mm256_hadd_ps(_mm256_hadd_ps(a4, a5), _mm256_hadd_ps(a6, a7));
+	// t0 is a0..a3 of the low lane then of the high lane, the same for t1 with a4..a7
+	return _mm256_add_ps(_mm256_permute2f128_ps(t0, t1, 0x20), _mm256_permute2f128_ps(t0, t1, 0x31));
+}
+
+__attribute__((target("avx2,fma")))
+static inline void TileAVX2(float * m, float * q, long long stride, float * s) {
+	__m256 a0 = _mm256_setzero_ps(), a1 = a0, a2 = a0, a3 = a0, a4 = a0, a5 = a0, a6 = a0, a7 = a0;
+	__m256 m0, m1, v;
+	long long c;
+	for (c = 0; c < stride; c += 8) {
+		m0 = _mm256_loadu_ps(m + c);
+		m1 = _mm256_loadu_ps(m + stride + c);
+		v = _mm256_loadu_ps(q + c);
+		a0 = _mm256_fmadd_ps(m0, v, a0);
+		a4 = _mm256_fmadd_ps(m1, v, a4);
+		v = _mm256_loadu_ps(q + stride + c);
+		a1 = _mm256_fmadd_ps(m0, v, a1);
+		a5 = _mm256_fmadd_ps(m1, v, a5);
+		v = _mm256_loadu_ps(q + 2 * stride + c);
+		a2 = _mm256_fmadd_ps(m0, v, a2);
+		a6 = _mm256_fmadd_ps(m1, v, a6);
+		v = _mm256_loadu_ps(q + 3 * stride + c);
+		a3 = _mm256_fmadd_ps(m0, v, a3);
+		a7 = _mm256_fmadd_ps(m1, v, a7);
+	}
+	_mm256_storeu_ps(s, Sum8x8(a0, a1, a2, a3, a4, a5, a6, a7));
+}
+
+// the 512 bit sums are folded to 256 bits before the horizontal sums
+__attribute__((target("avx512f")))
+static inline __m256 Fold512(__m512 a) {
+	return _mm256_add_ps(_mm512_castps512_ps256(a), _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(a), 1)));
+}
+
+__attribute__((target("avx512f,avx2")))
+static inline void TileAVX512(float * m, float * q, long long stride, float * s) {
+	__m512 a0 = _mm512_setzero_ps(), a1 = a0, a2 = a0, a3 = a0, a4 = a0, a5 = a0, a6 = a0, a7 = a0;
+	__m512 m0, m1, v;
+	long long c;
+	for (c = 0; c < stride; c += 16) {
+		m0 = _mm512_loadu_ps(m + c);
+		m1 = _mm512_loadu_ps(m + stride + c);
+		v = _mm512_loadu_ps(q + c);
+		a0 = _mm512_fmadd_ps(m0, v, a0);
+		a4 = _mm512_fmadd_ps(m1, v, a4);
+		v = _mm512_loadu_ps(q + stride + c);
+		a1 = _mm512_fmadd_ps(m0, v, a1);
+		a5 = _mm512_fmadd_ps(m1, v, a5);
+		v = _mm512_loadu_ps(q + 2 * stride + c);
+		a2 = _mm512_fmadd_ps(m0, v, a2);
+		a6 = _mm512_fmadd_ps(m1, v, a6);
+		v = _mm512_loadu_ps(q + 3 * stride + c);
+		a3 = _mm512_fmadd_ps(m0, v, a3);
+		a7 = _mm512_fmadd_ps(m1, v, a7);
+	}
+	_mm256_storeu_ps(s, Sum8x8(Fold512(a0), Fold512(a1), Fold512(a2), Fold512(a3),
+		Fold512(a4), Fold512(a5), Fold512(a6), Fold512(a7)));
+}
+#endif
+
+// picks the widest tile kernel the cpu supports, returns its name
+static inline char * InitTile(void (**tile)(float * m, float * q, long long stride, float * s)) {
+	*tile = TileScalar;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+		*tile = TileAVX512;
+		return (char *)"AVX-512";
+	}
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+		*tile = TileAVX2;
+		return (char *)"AVX2";
+	}
+#endif
+	return (char *)"scalar";
+}
+
+#endif
@@ -0,0 +1,282 @@
+//  The word vectors written by word2vec, as the query tools (distance, word-analogy,
+//  compute-accuracy) use them - read from any of the -binary formats (text, binary or
+//  the mapped model of model.h), normalized ONCE so that a cosine is a plain dot product,
+//  with a hash table of the words and the kernels that score rows against each other.
+//  * M - words x stride normalized vectors, rows padded with zeros to stride (a multiple
+//    of 16 reals, 64 bytes), and a zero row if words is odd (rows is even), so that
+//    the kernels never need a tail
+//  * strings, offsets - word a is strings + offsets[a]
+//  * lookup - open addressing hash table of the words (word index, -1 is empty), the
+//    first (most frequent) of equal words wins
+
+#ifndef VECTORS_H
+#define VECTORS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "model.h"
+#include "tile.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define VECTORS_MAX_STRING 100 // longest word, as in word2vec
+
+typedef float real;
+
+struct vectors {
+	long long words, size, stride, rows;
+	real * M;
+	char * strings;
+	long long * offsets;
+	int * lookup;
+	long long lookup_size;
+	// tile - s[i * 4 + j] = dot(m row i, q row j) for 2 rows of m and 4 of q,
+	// all rows stride reals apart
+	void (*tile)(real * m, real * q, long long stride, real * s);
+	// dot - of two rows, n is rounded up to 8 (the rows are padded with zeros)
+	real (*dot)(real * a, void * b, long long n);
+};
+
+static inline char * VectorsWord(struct vectors * v, long long a) {
+	return v->strings + v->offsets[a];
+}
+
+static inline real * VectorsRow(struct vectors * v, long long a) {
+	return v->M + a * v->stride;
+}
+
+// KERNELS, picked at runtime by InitVectorKernels depending on the cpu (the tile ones are in tile.h)
+static inline real DotScalar(real * a, void * b, long long n) {
+	real * v = (real *)b, f = 0;
+	long long c;
+	for (c = 0; c < n; c++) f += a[c] * v[c];
+	return f;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2,fma")))
+static inline real DotAVX2(real * a, void * b, long long n) {
+	real * v = (real *)b;
+	__m256 s = _mm256_setzero_ps();
+	__m128 t;
+	long long c;
+	for (c = 0; c < n; c += 8) s = _mm256_fmadd_ps(_mm256_loadu_ps(a + c), _mm256_loadu_ps(v + c), s);
+	t = _mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1));
+	t = _mm_add_ps(t, _mm_movehl_ps(t, t));
+	t = _mm_add_ss(t, _mm_shuffle_ps(t, t, 1));
+	return _mm_cvtss_f32(t);
+}
+#endif
+
+// returns the name of the tile kernels
+static inline char * InitVectorKernels(struct vectors * v) {
+	v->dot = DotScalar;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) v->dot = DotAVX2;
+#endif
+	return InitTile(&v->tile);
+}
+
+// the hash of word2vec
+static inline unsigned int GetWordHash(char * word, int len) {
+	unsigned long long a, hash = 0;
+	for (a = 0; a < len; a++)
+		hash = hash * 257 + word[a];
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	return (unsigned int)hash;
+}
+
+// (re)builds the hash table of the words, after they are read or changed
+static inline void InitLookup(struct vectors * v) {
+	long long a, b;
+	for (v->lookup_size = 1; v->lookup_size < 2 * v->words; v->lookup_size *= 2);
+	free(v->lookup);
+	v->lookup = (int *)malloc(v->lookup_size * sizeof(int));
+	if (v->lookup == NULL) {
+		printf("Memory allocation failed\n");
+		exit(1);
+	}
+	for (a = 0; a < v->lookup_size; a++) v->lookup[a] = -1;
+	for (a = 0; a < v->words; a++) {
+		b = GetWordHash(VectorsWord(v, a), strlen(VectorsWord(v, a))) & (v->lookup_size - 1);
+		while (v->lookup[b] != -1) b = (b + 1) & (v->lookup_size - 1);
+		v->lookup[b] = a;
+	}
+}
+
+// the index of word, -1 if it is not in the vectors
+static inline long long SearchWord(struct vectors * v, char * word) {
+	long long b = GetWordHash(word, strlen(word)) & (v->lookup_size - 1);
+	while (v->lookup[b] != -1) {
+		if (!strcmp(word, VectorsWord(v, v->lookup[b]))) return v->lookup[b];
+		b = (b + 1) & (v->lookup_size - 1);
+	}
+	return -1;
+}
+
+static inline void AllocVectors(struct vectors * v) {
+	v->stride = (v->size + 15) / 16 * 16;
+	v->rows = (v->words + 1) / 2 * 2;
+	if (posix_memalign((void **)&v->M, 64, v->rows * v->stride * sizeof(real))) {
+		printf("Memory allocation failed\n");
+		exit(1);
+	}
+	memset(v->M + v->words * v->stride, 0, (v->rows - v->words) * v->stride * sizeof(real));
+}
+
+// the first row of a word2vec file is text if it is all digits, signs, dots,
+// exponents and spaces - a binary row of floats practically never is. Only the
+// bytes up to the end of the row count, a short text row (e.g. of zeros) is
+// followed by the next word
+static inline int IsTextRow(FILE * f, long long size) {
+	long long a;
+	int ch, digits = 0;
+	while (((ch = fgetc(f)) != EOF) && (ch != ' '));
+	for (a = 0; a < size * (long long)sizeof(real); a++) {
+		ch = fgetc(f);
+		if ((ch == EOF) || (ch == '\n')) break;
+		if ((ch == 0) || !strchr("0123456789.-+eE ", ch)) return 0;
+		if ((ch >= '0') && (ch <= '9')) digits = 1;
+	}
+	return digits;
+}
+
+static inline void ReadWordFile(struct vectors * v, char * name, long long max_words) {
+	// text (-binary 0) and binary (-binary 1) files: "words size", then a row per word
+	long long a, b, len, cap = 1 << 20, pos;
+	char * line = NULL, * p, * end;
+	size_t line_cap = 0;
+	int ch, text;
+	FILE * f = fopen(name, "rb");
+	if (f == NULL) {
+		printf("Input file not found\n");
+		exit(1);
+	}
+	if ((fscanf(f, "%lld %lld", &v->words, &v->size) != 2) || (v->words < 1) || (v->size < 1)) {
+		printf("ERROR: %s is not a vector file\n", name);
+		exit(1);
+	}
+	if ((max_words > 0) && (v->words > max_words)) v->words = max_words;
+	pos = ftell(f);
+	text = IsTextRow(f, v->size);
+	fseek(f, pos, SEEK_SET);
+	AllocVectors(v);
+	v->strings = (char *)malloc(cap);
+	v->offsets = (long long *)malloc((v->words + 1) * sizeof(long long));
+	if ((v->strings == NULL) || (v->offsets == NULL)) {
+		printf("Memory allocation failed\n");
+		exit(1);
+	}
+	v->offsets[0] = 0;
+	for (a = 0; a < v->words; a++) {
+		// the word, after the newline that ends the previous row
+		len = 0;
+		if (v->offsets[a] + VECTORS_MAX_STRING + 1 > cap) {
+			cap *= 2;
+			v->strings = (char *)realloc(v->strings, cap);
+			if (v->strings == NULL) {
+				printf("Memory allocation failed\n");
+				exit(1);
+			}
+		}
+		while (((ch = fgetc(f)) != EOF) && (ch != ' ')) {
+			if ((ch == '\n') && (len == 0)) continue;
+			if (len < VECTORS_MAX_STRING - 1) v->strings[v->offsets[a] + len++] = ch;
+		}
+		v->strings[v->offsets[a] + len] = 0;
+		v->offsets[a + 1] = v->offsets[a] + len + 1;
+		if (ch == EOF) break;
+		if (text) {
+			if (getline(&line, &line_cap, f) == -1) break;
+			p = line;
+			for (b = 0; b < v->size; b++) {
+				VectorsRow(v, a)[b] = strtof(p, &end);
+				if (end == p) break;
+				p = end;
+			}
+			if (b < v->size) break;
+		} else if (fread(VectorsRow(v, a), sizeof(real), v->size, f) != v->size) break;
+		for (b = v->size; b < v->stride; b++) VectorsRow(v, a)[b] = 0;
+	}
+	fclose(f);
+	free(line);
+	if (a < v->words) {
+		printf("ERROR: %s is truncated\n", name);
+		exit(1);
+	}
+}
+
+static inline void ReadModelFile(struct vectors * v, char * name, long long max_words) {
+	// -binary 2: the words are used in place, the matrix is copied to be normalized
+	struct model md;
+	long long a;
+	a = MapModel(name, &md);
+	if (a != 0) {
+		if (a == -2) printf("ERROR: %s is not a complete model file\n", name);
+		else printf("ERROR: cannot map %s\n", name);
+		exit(1);
+	}
+	if (md.h->dtype != MODEL_FLOAT32) {
+		printf("ERROR: %s has an unknown dtype %lld\n", name, md.h->dtype);
+		exit(1);
+	}
+	v->words = md.h->vocab_size;
+	if ((max_words > 0) && (v->words > max_words)) v->words = max_words;
+	v->size = md.h->layer1_size;
+	AllocVectors(v);
+	for (a = 0; a < v->words; a++) {
+		memcpy(VectorsRow(v, a), (real *)md.matrix + a * v->size, v->size * sizeof(real));
+		memset(VectorsRow(v, a) + v->size, 0, (v->stride - v->size) * sizeof(real));
+	}
+	v->strings = md.strings;
+	v->offsets = md.index;
+}
+
+struct normalize_job {
+	struct vectors * v;
+	long long start, end;
+};
+
+static inline void * NormalizeThread(void * arg) {
+	struct normalize_job * job = (struct normalize_job *)arg;
+	long long a, b;
+	real len, * row;
+	for (a = job->start; a < job->end; a++) {
+		row = VectorsRow(job->v, a);
+		len = 0;
+		for (b = 0; b < job->v->size; b++) len += row[b] * row[b];
+		len = sqrt(len);
+		if (len > 0) for (b = 0; b < job->v->size; b++) row[b] /= len;
+	}
+	return NULL;
+}
+
+// reads the first max_words (0 - all) vectors of the file name, normalizes them
+// with num_threads threads and builds the hash table of the words
+static inline void ReadVectors(struct vectors * v, char * name, long long max_words, int num_threads) {
+	long long a;
+	pthread_t * pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+	struct normalize_job * jobs = (struct normalize_job *)malloc(num_threads * sizeof(struct normalize_job));
+	v->lookup = NULL;
+	if (IsModelFile(name)) ReadModelFile(v, name, max_words); else ReadWordFile(v, name, max_words);
+	for (a = 0; a < num_threads; a++) {
+		jobs[a].v = v;
+		jobs[a].start = v->words * a / num_threads;
+		jobs[a].end = v->words * (a + 1) / num_threads;
+		pthread_create(&pt[a], NULL, NormalizeThread, (void *)&jobs[a]);
+	}
+	for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+	free(pt);
+	free(jobs);
+	InitLookup(v);
+}
+
+#endif
@@ -0,0 +1,400 @@
+//  Copyright 2013 Google Inc. All Rights Reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+// The vocabulary engine shared by word2vec and word2phrase
+// * MapFile, ReadWordMapped - the text is memory-mapped and tokenized in place
+// * struct vocab_word - a word, its count and length, the string is in an arena
+// * struct vocab_bucket - open addressing hash table of words (FindBucket, BuildIndex)
+// * struct vocab_shard - a small vocab of its own, for counting a chunk of the text in a thread
+// * struct ids_header - the pre-encoded corpus (-save-ids / -read-ids), see PutId
+
+#ifndef VOCAB_H
+#define VOCAB_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MAX_STRING 100
+
+struct vocab_word {
+	long long cn; // word count, read from vocab file or counted from train
+	char *word; // the string, points into vocab_arena
+	int len; // strlen(word)
+};
+
+// bucket of the vocab hash table - the full hash and the first 8 chars of the word
+// sit next to its index, so a lookup rarely has to look at vocab[index].word at all
+// (and never does for words shorter than 8 chars, they are entirely in key)
+struct vocab_bucket {
+	unsigned int hash;
+	int index; // -1 - empty
+	unsigned long long key; // first 8 chars, 0-padded
+};
+
+// per-thread counting state for the parallel vocabulary pass,
+// every thread counts the words of one chunk of the train file into its own
+// small vocab (only word, len and cn are used) with its own table and arena,
+// the chunks are merged into the global vocab afterwards
+struct vocab_shard {
+	struct vocab_word * vocab;
+	struct vocab_bucket * hash;
+	char * arena;
+	long long size, max_size, hash_size, arena_size, arena_max;
+	long long words; // words counted in this chunk
+	long long start, end; // byte range of the chunk
+};
+
+// pre-encoded corpus (-save-ids / -read-ids): the train file is tokenized ONCE
+// and written as a stream of vocab indices behind a small header,
+// </s> (index 0) marks the sentence boundaries, words not in the vocab are left out
+struct ids_header {
+	char magic[8]; // "W2VIDS1"
+	long long width; // bytes per index: 2, 4 or 0 for varint (7 bits per byte)
+	long long vocab_size, vocab_checksum; // the vocab the indices refer to
+	long long words; // number of indices in the stream
+	long long data_size; // bytes in the stream after the header
+};
+
+// Maps a whole file into memory (read only), *size is set to -1 if it cannot be opened
+static inline char * MapFile(char * name, long long * size) {
+	struct stat st;
+	char * data = NULL;
+	int fd = open(name, O_RDONLY);
+	*size = -1;
+	if (fd == -1) return NULL;
+	fstat(fd, &st);
+	*size = st.st_size;
+	// mmap refuses empty mappings, an empty file simply has no data
+	if (*size > 0) {
+		data = (char *)mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+		if (data == MAP_FAILED) {
+			printf("ERROR: cannot map %s!\n", name);
+			exit(1);
+		}
+	}
+	close(fd);
+	return data;
+}
+
+// Reads a single word from the mapped text (data, size bytes), starting at *pos
+// SAME rules as ReadWord (CR skipped, SPACE + TAB + EOL as boundaries,
+// a new line becomes </s>, too long words truncated) but the word is NOT copied:
+// *word points right into data and the length is returned
+// (not 0-terminated). Only a word with a CR inside has to be glued
+// together in buf (MAX_STRING bytes).
+// Returns -1 at the end of file - a word cut by the end of file is dropped,
+// exactly like ReadWord + feof() does
+static inline int ReadWordMapped(char * data, long long size, char ** word, long long * pos, char * buf) {
+	long long p = *pos, begin;
+	int a, cr = 0;
+	char ch = 0;
+	// skip the leading blanks, a new line on its own is the end of sentence
+	while (p < size) {
+		ch = data[p];
+		if (ch == '\n') {
+			*pos = p + 1;
+			*word = (char *)"</s>";
+			return 4;
+		}
+		if ((ch != ' ') && (ch != '\t') && (ch != 13)) break;
+		p++;
+	}
+	begin = p;
+	while (p < size) {
+		ch = data[p];
+		if ((ch == ' ') || (ch == '\t') || (ch == '\n')) break;
+		if (ch == 13) cr = 1;
+		p++;
+	}
+	if (p >= size) {
+		*pos = p;
+		return -1;
+	}
+	// the new line is left for the next call - it will be read as </s>
+	*pos = (ch == '\n') ? p : p + 1;
+	if (!cr) {
+		*word = data + begin;
+		a = p - begin;
+		if (a > MAX_STRING - 2) a = MAX_STRING - 2; // Truncate too long words
+		return a;
+	}
+	// rare case - carriage returns inside the word
+	for (a = 0; begin < p; begin++) {
+		if (data[begin] == 13) continue;
+		buf[a] = data[begin];
+		if (a < MAX_STRING - 2) a++;
+	}
+	*word = buf;
+	return a;
+}
+
+static inline unsigned int GetWordHash(char * word, int len) {
+	unsigned long long a, hash = 0;
+	// 257 - the smallest prime greater than 255 (1 byte)
+	for (a = 0; a < len; a++)
+		hash = hash * 257 + word[a];
+	// mix the high bits down, only the low bits pick the bucket
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	return (unsigned int)hash;
+}
+
+static inline unsigned long long GetWordKey(char * word, int len) {
+	// first 8 chars of the word, 0-padded
+	unsigned long long key = 0;
+	memcpy(&key, word, (len < 8) ? len : 8);
+	return key;
+}
+
+static inline long long FindBucket(struct vocab_bucket * table, long long size, struct vocab_word * words,
+	char * word, int len, unsigned int hash, unsigned long long key) {
+	// Returns the bucket holding word (len chars), or the empty one where it belongs
+	long long b = hash & (size - 1);
+	int i;
+	while ((i = table[b].index) != -1) {
+		if ((table[b].hash == hash) && (table[b].key == key)) {
+			if (len < 8) return b;
+			// longer words - compare the rest
+			if ((words[i].len == len) && !memcmp(words[i].word + 8, word + 8, len - 8)) return b;
+		}
+		b = (b + 1) & (size - 1);
+	}
+	return b;
+}
+
+static inline void ResizeIndex(struct vocab_bucket ** table, long long * size, long long new_size) {
+	// Moves the buckets to a new table - the stored hashes are reused, the words are not read
+	struct vocab_bucket * old = *table;
+	long long a, b, old_size = *size;
+	*table = (struct vocab_bucket *)malloc(new_size * sizeof(struct vocab_bucket));
+	if (*table == NULL) {
+		printf("Memory allocation failed\n");
+		exit(1);
+	}
+	for (b = 0; b < new_size; b++) (*table)[b].index = -1;
+	*size = new_size;
+	for (a = 0; a < old_size; a++) if (old[a].index != -1) {
+		b = old[a].hash & (new_size - 1);
+		while ((*table)[b].index != -1) b = (b + 1) & (new_size - 1);
+		(*table)[b] = old[a];
+	}
+	free(old);
+}
+
+static inline void BuildIndex(struct vocab_bucket ** table, long long * size, struct vocab_word * words, long long n) {
+	// (Re)builds a table for words[0..n-1] with the smallest size that keeps the load under 0.7
+	long long a, b, new_size = 1024;
+	while (n > new_size * 0.7) new_size *= 2;
+	free(*table);
+	*table = (struct vocab_bucket *)malloc(new_size * sizeof(struct vocab_bucket));
+	if (*table == NULL) {
+		printf("Memory allocation failed\n");
+		exit(1);
+	}
+	for (b = 0; b < new_size; b++) (*table)[b].index = -1;
+	*size = new_size;
+	for (a = 0; a < n; a++) {
+		b = GetWordHash(words[a].word, words[a].len) & (new_size - 1);
+		while ((*table)[b].index != -1) b = (b + 1) & (new_size - 1);
+		(*table)[b].hash = GetWordHash(words[a].word, words[a].len);
+		(*table)[b].key = GetWordKey(words[a].word, words[a].len);
+		(*table)[b].index = a;
+	}
+}
+
+static inline char * ArenaAdd(char ** arena, long long * size, long long * max, struct vocab_word * words, long long n,
+	char * word, int len) {
+	// Appends word (len chars + 0) to an arena, the n words already pointing
+	// into it are moved along if the arena has to grow (while the old one is still there)
+	long long a;
+	char * p;
+	if (*size + len + 1 > *max) {
+		*max = (*max + len + 1) * 2;
+		p = (char *)malloc(*max);
+		if (p == NULL) {
+			printf("Memory allocation failed\n");
+			exit(1);
+		}
+		if (*size > 0) memcpy(p, *arena, *size);
+		for (a = 0; a < n; a++) words[a].word = p + (words[a].word - *arena);
+		free(*arena);
+		*arena = p;
+	}
+	p = *arena + *size;
+	memcpy(p, word, len);
+	p[len] = 0;
+	*size += len + 1;
+	return p;
+}
+
+static inline void CompactArena(char * arena, long long * size, struct vocab_word * words, long long n) {
+	// Packs the words left after a reduce to the front of the arena,
+	// the words must still be in the order they were added
+	long long a, p = 0;
+	for (a = 0; a < n; a++) {
+		memmove(arena + p, words[a].word, words[a].len + 1);
+		words[a].word = arena + p;
+		p += words[a].len + 1;
+	}
+	*size = p;
+}
+
+static inline int VocabCompare(const void * a, const void * b) {
+	// comparing words by their word counts
+	return ((struct vocab_word * )b)->cn - ((struct vocab_word * )a)->cn;
+}
+
+static inline void InitShard(struct vocab_shard * sh) {
+	sh->max_size = 1024;
+	sh->vocab = (struct vocab_word *)malloc(sh->max_size * sizeof(struct vocab_word));
+	if (sh->vocab == NULL) {
+		printf("Memory allocation failed\n");
+		exit(1);
+	}
+	BuildIndex(&sh->hash, &sh->hash_size, sh->vocab, 0);
+}
+
+static inline void FreeShard(struct vocab_shard * sh) {
+	free(sh->vocab);
+	free(sh->hash);
+	free(sh->arena);
+}
+
+static inline long long SearchShard(struct vocab_shard * sh, char * word, int len) {
+	// index of the word (len chars, not 0-terminated) in the shard, -1 if not found
+	unsigned int hash = GetWordHash(word, len);
+	long long b = FindBucket(sh->hash, sh->hash_size, sh->vocab, word, len, hash, GetWordKey(word, len));
+	return sh->hash[b].index;
+}
+
+static inline long long ShardAddWord(struct vocab_shard * sh, char * word, int len, long long cn) {
+	// counts cn occurrences of the word (len chars) in the shard, returns its index
+	unsigned int hash;
+	unsigned long long key;
+	long long b;
+	if (len > MAX_STRING - 1) len = MAX_STRING - 1; // Truncation
+	hash = GetWordHash(word, len);
+	key = GetWordKey(word, len);
+	b = FindBucket(sh->hash, sh->hash_size, sh->vocab, word, len, hash, key);
+	if (sh->hash[b].index != -1) {
+		sh->vocab[sh->hash[b].index].cn += cn;
+		return sh->hash[b].index;
+	}
+	if (sh->size >= sh->max_size) {
+		sh->max_size *= 2;
+		sh->vocab = (struct vocab_word *)realloc(sh->vocab, sh->max_size * sizeof(struct vocab_word));
+		if (sh->vocab == NULL) {
+			printf("Memory allocation failed\n");
+			exit(1);
+		}
+	}
+	sh->vocab[sh->size].word = ArenaAdd(&sh->arena, &sh->arena_size, &sh->arena_max, sh->vocab, sh->size, word, len);
+	sh->vocab[sh->size].len = len;
+	sh->vocab[sh->size].cn = cn;
+	sh->hash[b].hash = hash;
+	sh->hash[b].key = key;
+	sh->hash[b].index = sh->size;
+	sh->size++;
+	if (sh->size > sh->hash_size * 0.7) ResizeIndex(&sh->hash, &sh->hash_size, sh->hash_size * 2);
+	return sh->size - 1;
+}
+
+static inline void ReduceShard(struct vocab_shard * sh, int * min_reduce) {
+	// same as ReduceVocab, for one shard - all the shards share min_reduce,
+	// so the threshold keeps growing no matter which thread hits the limit
+	long long a, b = 0;
+	long long threshold = *min_reduce;
+	for (a = 0; a < sh->size; a++) {
+		if (sh->vocab[a].cn > threshold) sh->vocab[b++] = sh->vocab[a];
+	}
+	sh->size = b;
+	CompactArena(sh->arena, &sh->arena_size, sh->vocab, sh->size);
+	BuildIndex(&sh->hash, &sh->hash_size, sh->vocab, sh->size);
+	// another shard might have raised it already
+	__sync_bool_compare_and_swap(min_reduce, (int)threshold, (int)threshold + 1);
+}
+
+// the shards of all the threads share ONE limit of entries, total counts the entries
+// of all of them (a word in two shards twice) - after added new entries in sh, it is
+// reduced if the total is over the limit and sh holds more than its share of it, a
+// smaller shard keeps growing. Nothing is reduced before the whole limit is reached,
+// as with a single thread, but what is reduced then (and min_reduce) depends on how
+// the text was split, so on the number of threads.
+static inline void ShardCheckLimit(struct vocab_shard * sh, long long added, long long * total,
+		long long limit, int n, int * min_reduce) {
+	long long size;
+	if (added == 0) return;
+	if ((__sync_add_and_fetch(total, added) <= limit) || (sh->size <= limit / n)) return;
+	size = sh->size;
+	ReduceShard(sh, min_reduce);
+	__sync_sub_and_fetch(total, size - sh->size);
+}
+
+static inline long long ShardStart(char * data, long long size, long long pos) {
+	// Moves pos to the first word that STARTS at or after pos,
+	// a word that crosses pos belongs to the chunk before
+	long long p = pos - 1;
+	char ch;
+	if (pos == 0) return 0;
+	while ((p > 0) && (data[p] == 13)) p--;
+	ch = data[p];
+	// (only CRs before pos - nothing started yet)
+	if ((ch == ' ') || (ch == '\t') || (ch == '\n') || (ch == 13)) return pos;
+	while (pos < size) {
+		ch = data[pos];
+		if ((ch == ' ') || (ch == '\t') || (ch == '\n')) break;
+		pos++;
+	}
+	return pos;
+}
+
+static inline long long VocabChecksum(struct vocab_word * words, long long n) {
+	// FNV-1a over the words and counts, in vocab order - the indices
+	// in an ids file are only meaningful for exactly the same vocab
+	unsigned long long a, hash = 14695981039346656037ULL;
+	char * c;
+	for (a = 0; a < n; a++) {
+		for (c = words[a].word; *c; c++) hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+		hash = (hash ^ (unsigned long long)words[a].cn) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+static inline int PutId(unsigned char * out, int width, int word) {
+	// Encodes one index of an ids stream at out, returns the bytes written
+	int a = 0;
+	if (width == 2) {
+		*(unsigned short *)out = word;
+		return 2;
+	}
+	if (width == 4) {
+		*(unsigned int *)out = word;
+		return 4;
+	}
+	// varint - the high bit says "more bytes follow"
+	while (word >= 0x80) {
+		out[a++] = (word & 0x7F) | 0x80;
+		word >>= 7;
+	}
+	out[a++] = word;
+	return a;
+}
+
+#endif
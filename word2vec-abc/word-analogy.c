@@ -0,0 +1,166 @@
+//  Copyright 2013 Google Inc. All Rights Reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+// Analogies in the vectors written by word2vec, as the original word-analogy: for
+// "a b c" (a is to b as c is to ?) the closest words to b - a + c, a, b and c left out.
+// The vectors can be in any of the -binary formats (see vectors.h).
+
+// how it works
+// * the vectors are normalized once at load time, a cosine is a plain dot product
+// * the threads split the words in ranges, every thread keeps its top words
+//   (best first, like the list of the original), the lists are merged at the end
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "vectors.h"
+
+#define MAX_STRING 100
+#define MAX_QUERY 2000 // longest query line
+
+char file_name[MAX_STRING];
+int top = 40, num_threads = 0;
+struct vectors vec;
+
+// the current query: the vocab indices of a, b, c and the vector b - a + c
+long long word[3];
+real * Q;
+// best_score, best_word - [thread][top] the best words of each thread, best first
+real * best_score;
+long long * best_word;
+
+// puts w with score s into the sorted list of n, if it is good enough
+static inline void Insert(real * score, long long * words, int n, real s, long long w) {
+	int a = n - 1;
+	if (s <= score[a]) return;
+	while ((a > 0) && (s > score[a - 1])) {
+		score[a] = score[a - 1];
+		words[a] = words[a - 1];
+		a--;
+	}
+	score[a] = s;
+	words[a] = w;
+}
+
+void *SearchThread(void *id) {
+	long long a, start = vec.words * (long long)id / num_threads, end = vec.words * ((long long)id + 1) / num_threads;
+	real * bs = best_score + (long long)id * top;
+	long long * bw = best_word + (long long)id * top;
+	for (a = 0; a < top; a++) {
+		bs[a] = -2; // below any cosine
+		bw[a] = -1;
+	}
+	for (a = start; a < end; a++) {
+		if ((a == word[0]) || (a == word[1]) || (a == word[2])) continue;
+		Insert(bs, bw, top, vec.dot(Q, VectorsRow(&vec, a), vec.stride), a);
+	}
+	pthread_exit(NULL);
+}
+
+// the query vector of line, 0 if it is not three known words
+int ParseQuery(char * line) {
+	char st[3][MAX_QUERY], extra[MAX_QUERY];
+	long long a, b;
+	real len = 0;
+	if (sscanf(line, "%s %s %s %s", st[0], st[1], st[2], extra) != 3) {
+		printf("Only three words are allowed\n");
+		return 0;
+	}
+	for (a = 0; a < 3; a++) {
+		word[a] = SearchWord(&vec, st[a]);
+		printf("\nWord: %s  Position in vocabulary: %lld\n", st[a], word[a]);
+		if (word[a] == -1) {
+			printf("Out of dictionary word!\n");
+			return 0;
+		}
+	}
+	for (b = 0; b < vec.stride; b++) Q[b] = VectorsRow(&vec, word[1])[b] - VectorsRow(&vec, word[0])[b] + VectorsRow(&vec, word[2])[b];
+	for (b = 0; b < vec.size; b++) len += Q[b] * Q[b];
+	len = sqrt(len);
+	if (len > 0) for (b = 0; b < vec.size; b++) Q[b] /= len;
+	return 1;
+}
+
+void Search() {
+	long long a, i;
+	pthread_t * pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+	for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, SearchThread, (void *)a);
+	for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+	free(pt);
+	// the ranges are in word order, so the first of equal scores stays first
+	for (a = 1; a < num_threads; a++) for (i = 0; i < top; i++)
+		Insert(best_score, best_word, top, best_score[a * top + i], best_word[a * top + i]);
+}
+
+int ArgPos(char *str, int argc, char **argv) {
+	int a;
+	for (a = 1; a < argc; a++) if (!strcmp(str, argv[a])) {
+		if (a == argc - 1) {
+			printf("Argument missing for %s\n", str);
+			exit(1);
+		}
+		return a;
+	}
+	return -1;
+}
+
+int main(int argc, char **argv) {
+	char line[MAX_QUERY];
+	long long a;
+	int i;
+	if (argc < 2) {
+		printf("Usage: ./word-analogy <FILE> [options]\nwhere FILE contains word projections in any of the formats of word2vec -binary\n\n");
+		printf("Options:\n");
+		printf("\t-top <int>\n");
+		printf("\t\tNumber of closest words to show; default is 40\n");
+		printf("\t-threads <int>\n");
+		printf("\t\tUse <int> threads; default is the number of cpus\n");
+		printf("\nExamples:\n");
+		printf("./word-analogy vectors.bin\n\n");
+		return 0;
+	}
+	strcpy(file_name, argv[1]);
+	if ((i = ArgPos((char *)"-top", argc, argv)) > 0) top = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
+	if (num_threads < 1) num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (top < 1) {
+		printf("ERROR: -top must be positive\n");
+		return 1;
+	}
+	InitVectorKernels(&vec);
+	ReadVectors(&vec, file_name, 0, num_threads);
+	if (posix_memalign((void **)&Q, 64, vec.stride * sizeof(real))) Q = NULL;
+	best_score = (real *)malloc((long long)num_threads * top * sizeof(real));
+	best_word = (long long *)malloc((long long)num_threads * top * sizeof(long long));
+	if ((Q == NULL) || (best_score == NULL) || (best_word == NULL)) {
+		printf("Memory allocation failed\n");
+		return 1;
+	}
+	while (1) {
+		printf("Enter three words (EXIT to break): ");
+		fflush(stdout);
+		if (fgets(line, MAX_QUERY, stdin) == NULL) break;
+		line[strcspn(line, "\r\n")] = 0;
+		if (!strcmp(line, "EXIT")) break;
+		if (!ParseQuery(line)) continue;
+		Search();
+		printf("\n                                              Word              Distance\n------------------------------------------------------------------------\n");
+		for (a = 0; a < top; a++) if (best_word[a] != -1)
+			printf("%50s\t\t%f\n", VectorsWord(&vec, best_word[a]), best_score[a]);
+	}
+	return 0;
+}
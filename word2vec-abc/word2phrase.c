@@ -0,0 +1,513 @@
+//  Copyright 2013 Google Inc. All Rights Reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+// Phrase detection, as the original word2phrase: two words a b next to each other
+// become the single word a_b if
+//     (cn(a b) - min_count) / cn(a) / cn(b) * train_words > threshold
+// where cn counts the words and the bigrams of the train file. A word joined to
+// the one before it is not joined to the one after it, so one pass makes phrases
+// of two words and every further pass (-passes) can make them longer
+// (new_york + times -> new_york_times). Bigrams do not cross the sentences (lines).
+
+// how it works - every pass
+// * the text is mapped and cut into one chunk per thread, every thread counts the
+//   words and the bigrams of its chunk in its own shard (vocab.h, the same as the
+//   vocabulary pass of word2vec), the shards are merged and the counts under
+//   min_count are dropped - such words and bigrams can never make a phrase. The shards
+//   share the limit of phrase_hash_size * 0.7 entries (see ShardCheckLimit), once it
+//   is reached the counts that are reduced depend on the number of threads
+// * the text is rewritten in rounds of num_threads chunks of REWRITE_CHUNK bytes, the
+//   threads rewrite their chunks into buffers that are written out in order
+// * whether a word is joined depends on the words before it, so a chunk starts
+//   (and the chunk before it stops) at its first SYNC POINT - a word that is not
+//   joined whatever came before (see SyncPoint)
+// * the passes before the last one write to <output>.pass<n>, removed afterwards
+// With -save-ids the last pass also counts the phrased words, and a second run
+// over its chunks writes the vocab and the ids stream of the phrased text for
+// word2vec -read-vocab / -read-ids, the same files word2vec -save-vocab / -save-ids
+// would write from the phrased text - so the text (-output) is not even needed
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "vocab.h"
+
+#define REWRITE_CHUNK (1 << 24) // bytes of text a thread rewrites at a time
+
+// Maximum 500M * 0.7 words and bigrams while counting, as the original word2phrase
+const long long phrase_hash_size = 500000000;
+// and 30M * 0.7 in the vocab of the phrased text, as word2vec
+const long long vocab_hash_size = 30000000;
+
+typedef float real;
+
+// a rewritten chunk, and with -save-ids the phrased words counted in it
+struct rewrite_job {
+	long long start, end; // byte range of the chunk
+	char * out; // the text or the ids of the chunk
+	long long out_size, out_max;
+	long long ids, phrases; // indices / phrases written
+	struct vocab_shard vocab;
+};
+
+char train_file[MAX_STRING], output_file[MAX_STRING];
+char save_vocab_file[MAX_STRING], save_ids_file[MAX_STRING];
+int debug_mode = 2, min_count = 5, num_threads = 0, passes = 1, ids_width = 0;
+// min_reduce - of the counts of a pass, vocab_reduce - of the vocab of the phrased text
+int min_reduce = 1, vocab_reduce = 1;
+real threshold = 100;
+
+// the text of the current pass, mapped
+char * data;
+long long data_size;
+// counts - the words and the bigrams of the current pass, a bigram is
+// kept as "a b" (a word never has a space, so they never clash)
+struct vocab_shard counts;
+long long train_words;
+// the vocab of the phrased text (-save-ids)
+struct vocab_shard vocab;
+// emit_text - rewrite to text, emit_count - count the phrased words in vocab,
+// emit_ids - rewrite to indices of vocab
+int emit_text, emit_count, emit_ids;
+struct vocab_shard * shards;
+long long words_done = 0;
+// entries in all the shards, see ShardCheckLimit
+long long shard_total = 0;
+// indices written by the last Rewrite
+long long ids_written;
+
+double SecondsSince(struct timespec * t) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) + (now.tv_nsec - t->tv_nsec) / 1e9;
+}
+
+static inline int IsEos(char * word, int len) {
+	return (len == 4) && !memcmp(word, "</s>", 4);
+}
+
+// the key of the bigram a b in counts, cut like ShardAddWord cuts it
+static inline int BigramKey(char * key, char * a, int la, char * b, int lb) {
+	memcpy(key, a, la);
+	key[la] = ' ';
+	memcpy(key + la + 1, b, lb);
+	return (la + 1 + lb > MAX_STRING - 1) ? MAX_STRING - 1 : la + 1 + lb;
+}
+
+void * CountThread(void * id) {
+	// counts the words and bigrams of one chunk - a word belongs to the chunk it
+	// starts in, the bigram of the last word and the first word of the next
+	// chunk is counted here, the next chunk does not know the word before
+	struct vocab_shard * sh = &shards[(long long)id];
+	long long pos = ShardStart(data, data_size, sh->start), done, size = sh->size;
+	char buf[MAX_STRING], last[MAX_STRING], key[2 * MAX_STRING], * word, ch;
+	int len, last_len = 0, past; // last_len 0 - at the start of a sentence
+	while (1) {
+		while (pos < sh->end) {
+			ch = data[pos];
+			if ((ch != ' ') && (ch != '\t') && (ch != 13)) break;
+			pos++;
+		}
+		past = (pos >= sh->end);
+		if (past && (last_len == 0)) break;
+		len = ReadWordMapped(data, data_size, &word, &pos, buf);
+		if (len < 0) break;
+		if (IsEos(word, len)) {
+			if (past) break;
+			last_len = 0;
+			continue;
+		}
+		if (last_len > 0) ShardAddWord(sh, key, BigramKey(key, last, last_len, word, len), 1);
+		if (past) break;
+		ShardAddWord(sh, word, len, 1);
+		memcpy(last, word, len);
+		last_len = len;
+		sh->words++;
+		if ((sh->words % 100000) == 0) {
+			done = __sync_add_and_fetch(&words_done, 100000);
+			if (debug_mode > 1) {
+				printf("%lldK%c", done / 1000, 13);
+				fflush(stdout);
+			}
+		}
+		// the whole limit is shared between the threads
+		ShardCheckLimit(sh, sh->size - size, &shard_total, phrase_hash_size * 0.7, num_threads, &min_reduce);
+		size = sh->size;
+	}
+	pthread_exit(NULL);
+}
+
+void CountPhrases() {
+	long long a, t;
+	int keep = min_count - 1;
+	pthread_t * pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+	shards = (struct vocab_shard *)calloc(num_threads, sizeof(struct vocab_shard));
+	words_done = 0;
+	shard_total = 0;
+	for (t = 0; t < num_threads; t++) {
+		InitShard(&shards[t]);
+		shards[t].start = data_size / num_threads * t;
+		shards[t].end = (t == num_threads - 1) ? data_size : data_size / num_threads * (t + 1);
+		pthread_create(&pt[t], NULL, CountThread, (void *)t);
+	}
+	for (t = 0; t < num_threads; t++) pthread_join(pt[t], NULL);
+	// the first shard becomes counts, the others are merged into it
+	FreeShard(&counts);
+	counts = shards[0];
+	train_words = shards[0].words;
+	for (t = 1; t < num_threads; t++) {
+		train_words += shards[t].words;
+		for (a = 0; a < shards[t].size; a++) {
+			ShardAddWord(&counts, shards[t].vocab[a].word, shards[t].vocab[a].len, shards[t].vocab[a].cn);
+			if (counts.size > phrase_hash_size * 0.7) ReduceShard(&counts, &min_reduce);
+		}
+		FreeShard(&shards[t]);
+	}
+	free(shards);
+	free(pt);
+	// keeps the counts of min_count and more
+	ReduceShard(&counts, &keep);
+}
+
+// the bigram a b is a phrase (a word not in counts is under min_count)
+static inline int IsPhrase(char * a, int la, char * b, int lb) {
+	char key[2 * MAX_STRING];
+	long long i, pa, pb, pab;
+	if ((i = SearchShard(&counts, a, la)) == -1) return 0;
+	pa = counts.vocab[i].cn;
+	if ((i = SearchShard(&counts, b, lb)) == -1) return 0;
+	pb = counts.vocab[i].cn;
+	if ((i = SearchShard(&counts, key, BigramKey(key, a, la, b, lb))) == -1) return 0;
+	pab = counts.vocab[i].cn;
+	return (pab - min_count) / (real)pa / (real)pb * (real)train_words > threshold;
+}
+
+long long SyncPoint(long long pos, int * line_start) {
+	// The position of the first word after the first one that starts at or after pos
+	// and is not joined to the word before it no matter what - a new line, the first
+	// word of a line, or a word the one before it does not make a phrase with.
+	// data_size if there is none. line_start - the word before it was a new line
+	char buf[MAX_STRING], last[MAX_STRING], * word;
+	int len, last_len;
+	long long p;
+	pos = ShardStart(data, data_size, pos);
+	if ((last_len = ReadWordMapped(data, data_size, &word, &pos, buf)) < 0) return data_size;
+	if (IsEos(word, last_len)) last_len = 0; else memcpy(last, word, last_len);
+	while (1) {
+		p = pos;
+		if ((len = ReadWordMapped(data, data_size, &word, &pos, buf)) < 0) return data_size;
+		if ((last_len == 0) || IsEos(word, len) || !IsPhrase(last, last_len, word, len)) {
+			*line_start = (last_len == 0);
+			return p;
+		}
+		memcpy(last, word, len);
+		last_len = len;
+	}
+}
+
+void Emit(struct rewrite_job * job, char * word, int len, int * line_start) {
+	// Writes a word (or </s>) of the phrased text in the ways asked for
+	long long i;
+	int eos = IsEos(word, len);
+	if (job->out_size + len + 16 > job->out_max) {
+		job->out_max = (job->out_max + len + 16) * 2;
+		job->out = (char *)realloc(job->out, job->out_max);
+		if (job->out == NULL) {
+			printf("Memory allocation failed\n");
+			exit(1);
+		}
+	}
+	if (emit_text) {
+		if (eos) job->out[job->out_size++] = '\n';
+		else {
+			if (!*line_start) job->out[job->out_size++] = ' ';
+			memcpy(job->out + job->out_size, word, len);
+			job->out_size += len;
+		}
+	}
+	*line_start = eos;
+	// word2vec reads the words of the text cut to MAX_STRING - 2 chars
+	if (len > MAX_STRING - 2) len = MAX_STRING - 2;
+	if (emit_count) ShardAddWord(&job->vocab, word, len, 1);
+	if (emit_ids && ((i = SearchShard(&vocab, word, len)) != -1)) {
+		job->out_size += PutId((unsigned char *)job->out + job->out_size, ids_width, i);
+		job->ids++;
+	}
+}
+
+void * RewriteThread(void * arg) {
+	// Rewrites the words from the sync point of the chunk to the sync point of the next
+	// one, a word waits in last until it is known whether the next one joins it
+	struct rewrite_job * job = (struct rewrite_job *)arg;
+	char buf[MAX_STRING], last[MAX_STRING], phrase[2 * MAX_STRING], * word;
+	int len, last_len = 0, line_start = 1, dummy;
+	long long pos = 0, start, stop = data_size;
+	if (job->start > 0) pos = SyncPoint(job->start, &line_start);
+	if (job->end < data_size) stop = SyncPoint(job->end, &dummy);
+	start = pos;
+	while (pos < stop) {
+		if ((len = ReadWordMapped(data, data_size, &word, &pos, buf)) < 0) break;
+		if (IsEos(word, len)) {
+			if (last_len > 0) Emit(job, last, last_len, &line_start);
+			Emit(job, word, len, &line_start);
+			last_len = 0;
+		} else if ((last_len > 0) && IsPhrase(last, last_len, word, len)) {
+			memcpy(phrase, last, last_len);
+			phrase[last_len] = '_';
+			memcpy(phrase + last_len + 1, word, len);
+			Emit(job, phrase, last_len + 1 + len, &line_start);
+			job->phrases++;
+			last_len = 0;
+		} else {
+			if (last_len > 0) Emit(job, last, last_len, &line_start);
+			memcpy(last, word, len);
+			last_len = len;
+		}
+	}
+	if (last_len > 0) Emit(job, last, last_len, &line_start);
+	// the text always ends with a new line, the last words are not lost to word2vec
+	if ((stop == data_size) && (start < stop) && !line_start) Emit(job, (char *)"</s>", 4, &line_start);
+	pthread_exit(NULL);
+}
+
+long long Rewrite(FILE * fo) {
+	// Rewrites the whole text in rounds of num_threads chunks to fo (NULL - only
+	// counting), returns the number of phrases
+	long long a, b, t, n, chunks, phrases = 0;
+	pthread_t * pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+	struct rewrite_job * jobs = (struct rewrite_job *)calloc(num_threads, sizeof(struct rewrite_job));
+	chunks = (data_size + REWRITE_CHUNK - 1) / REWRITE_CHUNK;
+	if (chunks < num_threads) chunks = num_threads;
+	if (emit_count) {
+		FreeShard(&vocab);
+		memset(&vocab, 0, sizeof(vocab));
+		InitShard(&vocab);
+		// always </s> first, as word2vec
+		ShardAddWord(&vocab, (char *)"</s>", 4, 0);
+	}
+	for (a = 0; a < chunks; a += num_threads) {
+		n = (chunks - a < num_threads) ? chunks - a : num_threads;
+		for (t = 0; t < n; t++) {
+			jobs[t].start = data_size * (a + t) / chunks;
+			jobs[t].end = data_size * (a + t + 1) / chunks;
+			jobs[t].out_size = 0;
+			if (emit_count) InitShard(&jobs[t].vocab);
+			pthread_create(&pt[t], NULL, RewriteThread, (void *)&jobs[t]);
+		}
+		for (t = 0; t < n; t++) pthread_join(pt[t], NULL);
+		// in order - the words of the vocab come in the order they first appear, as in word2vec
+		for (t = 0; t < n; t++) {
+			if ((fo != NULL) && (jobs[t].out_size > 0)) fwrite(jobs[t].out, 1, jobs[t].out_size, fo);
+			if (!emit_count) continue;
+			for (b = 0; b < jobs[t].vocab.size; b++) {
+				ShardAddWord(&vocab, jobs[t].vocab.vocab[b].word, jobs[t].vocab.vocab[b].len, jobs[t].vocab.vocab[b].cn);
+				if (vocab.size > vocab_hash_size * 0.7) ReduceShard(&vocab, &vocab_reduce);
+			}
+			FreeShard(&jobs[t].vocab);
+			memset(&jobs[t].vocab, 0, sizeof(jobs[t].vocab));
+		}
+		if (debug_mode > 1) {
+			printf("%.1f%%%c", 100.0 * (a + n) / chunks, 13);
+			fflush(stdout);
+		}
+	}
+	ids_written = 0;
+	for (t = 0; t < num_threads; t++) {
+		phrases += jobs[t].phrases;
+		ids_written += jobs[t].ids;
+		free(jobs[t].out);
+	}
+	free(jobs);
+	free(pt);
+	return phrases;
+}
+
+void SortVocab() {
+	// as SortVocab of word2vec - </s> stays first, the others by count, the ones under min_count are dropped
+	long long a;
+	qsort(&vocab.vocab[1], vocab.size - 1, sizeof(struct vocab_word), VocabCompare);
+	for (a = 1; a < vocab.size; a++) if (vocab.vocab[a].cn < min_count) break;
+	vocab.size = a;
+	BuildIndex(&vocab.hash, &vocab.hash_size, vocab.vocab, vocab.size);
+}
+
+void SaveIds() {
+	// Saves the vocab of the phrased text and encodes the text of the last pass again with it
+	long long a;
+	struct ids_header h;
+	FILE * fo;
+	SortVocab();
+	fo = fopen(save_vocab_file, "wb");
+	if (fo == NULL) {
+		printf("ERROR: cannot open %s!\n", save_vocab_file);
+		exit(1);
+	}
+	for (a = 0; a < vocab.size; a++) fprintf(fo, "%s %lld\n", vocab.vocab[a].word, vocab.vocab[a].cn);
+	fclose(fo);
+	// word2vec -read-vocab sorts the vocab again, the indices are for that order
+	SortVocab();
+	if ((ids_width == 2) && (vocab.size > 65536)) {
+		printf("ERROR: vocab of %lld words does not fit in 16 bit indices\n", vocab.size);
+		exit(1);
+	}
+	fo = fopen(save_ids_file, "wb");
+	if (fo == NULL) {
+		printf("ERROR: cannot open %s!\n", save_ids_file);
+		exit(1);
+	}
+	memset(&h, 0, sizeof(h));
+	strcpy(h.magic, "W2VIDS1");
+	h.width = ids_width;
+	h.vocab_size = vocab.size;
+	h.vocab_checksum = VocabChecksum(vocab.vocab, vocab.size);
+	// header is rewritten at the end, when words and data_size are known
+	fwrite(&h, sizeof(h), 1, fo);
+	emit_text = 0;
+	emit_count = 0;
+	emit_ids = 1;
+	Rewrite(fo);
+	h.data_size = ftell(fo) - sizeof(h);
+	h.words = ids_written;
+	fseek(fo, 0, SEEK_SET);
+	fwrite(&h, sizeof(h), 1, fo);
+	fclose(fo);
+	if (debug_mode > 0) {
+		printf("Vocab size: %lld\n", vocab.size);
+		printf("Saved %lld indices (%lld bytes) to %s\n", h.words, h.data_size, save_ids_file);
+	}
+}
+
+void TrainModel() {
+	char name[MAX_STRING + 16], last_name[MAX_STRING + 16], * base;
+	long long phrases;
+	int pass;
+	FILE * fo;
+	struct timespec t;
+	base = (output_file[0] != 0) ? output_file : save_ids_file;
+	strcpy(last_name, train_file);
+	for (pass = 1; pass <= passes; pass++) {
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		data = MapFile(last_name, &data_size);
+		if (data_size < 0) {
+			printf("ERROR: training data file not found!\n");
+			exit(1);
+		}
+		CountPhrases();
+		if (debug_mode > 0) {
+			printf("Pass %d: words and bigrams: %lld, words in train file: %lld\n", pass, counts.size, train_words);
+			fflush(stdout);
+		}
+		// the last pass writes the output (if any) and counts the phrased words for -save-ids
+		emit_text = (pass < passes) || (output_file[0] != 0);
+		emit_count = (pass == passes) && (save_ids_file[0] != 0);
+		emit_ids = 0;
+		if (pass < passes) sprintf(name, "%s.pass%d", base, pass); else strcpy(name, output_file);
+		fo = NULL;
+		if (emit_text && ((fo = fopen(name, "wb")) == NULL)) {
+			printf("ERROR: cannot open %s!\n", name);
+			exit(1);
+		}
+		phrases = Rewrite(fo);
+		if (fo != NULL) fclose(fo);
+		if (emit_count) SaveIds();
+		if (data_size > 0) munmap(data, data_size);
+		if (pass > 1) unlink(last_name);
+		strcpy(last_name, name);
+		if (debug_mode > 0) printf("Pass %d: %lld phrases in %.2fs\n", pass, phrases, SecondsSince(&t));
+	}
+}
+
+int ArgPos(char *str, int argc, char **argv) {
+	int a;
+	for (a = 1; a < argc; a++) if (!strcmp(str, argv[a])) {
+		if (a == argc - 1) {
+			printf("Argument missing for %s\n", str);
+			exit(1);
+		}
+		return a;
+	}
+	return -1;
+}
+
+int main(int argc, char **argv) {
+	int i;
+	if (argc == 1) {
+		printf("WORD2PHRASE tool v0.1a\n\n");
+		printf("Options:\n");
+		printf("Parameters for training:\n");
+		printf("\t-train <file>\n");
+		printf("\t\tUse text data from <file> to train the model\n");
+		printf("\t-output <file>\n");
+		printf("\t\tUse <file> to save the resulting phrases\n");
+		printf("\t-min-count <int>\n");
+		printf("\t\tThis will discard words that appear less than <int> times; default is 5\n");
+		printf("\t-threshold <float>\n");
+		printf("\t\t The <float> value represents threshold for forming the phrases (higher means less phrases); default 100\n");
+		printf("\t-passes <int>\n");
+		printf("\t\tRun <int> passes, every pass can join the phrases of the one before (longer phrases); default is 1\n");
+		printf("\t-threads <int>\n");
+		printf("\t\tUse <int> threads; default is the number of cpus (the counts reduced on a text of\n");
+		printf("\t\tmore than 350M different words and bigrams depend on it)\n");
+		printf("\t-save-vocab <file>\n");
+		printf("\t\tThe vocabulary of the phrased text will be saved to <file>, for word2vec -read-vocab; needed by -save-ids\n");
+		printf("\t-save-ids <file>\n");
+		printf("\t\tThe phrased text will be encoded to vocabulary indices and saved to <file>, for word2vec -read-ids\n");
+		printf("\t\t(train with the same -min-count); -output is then optional\n");
+		printf("\t-ids-width <int>\n");
+		printf("\t\tBytes per index for -save-ids: 2, 4 or 0 (variable length); default is 0\n");
+		printf("\t-debug <int>\n");
+		printf("\t\tSet the debug mode (default = 2 = more info during training)\n");
+		printf("\nExamples:\n");
+		printf("./word2phrase -train text.txt -output phrases.txt -threshold 100 -debug 2\n");
+		printf("./word2phrase -train text.txt -passes 2 -save-vocab vocab.txt -save-ids phrases.ids\n\n");
+		return 0;
+	}
+	train_file[0] = 0;
+	output_file[0] = 0;
+	save_vocab_file[0] = 0;
+	save_ids_file[0] = 0;
+	if ((i = ArgPos((char *)"-train", argc, argv)) > 0) strcpy(train_file, argv[i + 1]);
+	if ((i = ArgPos((char *)"-debug", argc, argv)) > 0) debug_mode = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *)"-output", argc, argv)) > 0) strcpy(output_file, argv[i + 1]);
+	if ((i = ArgPos((char *)"-min-count", argc, argv)) > 0) min_count = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *)"-threshold", argc, argv)) > 0) threshold = atof(argv[i + 1]);
+	if ((i = ArgPos((char *)"-passes", argc, argv)) > 0) passes = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *)"-save-vocab", argc, argv)) > 0) strcpy(save_vocab_file, argv[i + 1]);
+	if ((i = ArgPos((char *)"-save-ids", argc, argv)) > 0) strcpy(save_ids_file, argv[i + 1]);
+	if ((i = ArgPos((char *)"-ids-width", argc, argv)) > 0) ids_width = atoi(argv[i + 1]);
+	if (num_threads < 1) num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if ((output_file[0] == 0) && (save_ids_file[0] == 0)) {
+		printf("ERROR: -output or -save-ids is needed\n");
+		return 1;
+	}
+	if ((save_ids_file[0] != 0) && (save_vocab_file[0] == 0)) {
+		printf("ERROR: -save-ids needs -save-vocab, the indices refer to it\n");
+		return 1;
+	}
+	if ((ids_width != 0) && (ids_width != 2) && (ids_width != 4)) {
+		printf("ERROR: -ids-width must be 0 (varint), 2 or 4\n");
+		return 1;
+	}
+	if (passes < 1) {
+		printf("ERROR: -passes must be positive\n");
+		return 1;
+	}
+	TrainModel();
+	return 0;
+}
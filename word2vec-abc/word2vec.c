@@ -29,60 +29,201 @@
 // main datastructure 
 // * struct vocab_word - structure for word in vocabulary
 // * vocab - the collection of all vocab_words (size: vocab_max_size, vocab_size)
-// * vocab_hash - the collection of integers (hash of words), (size: vocab_hash_size)
-// *** the values in vocab_hash are the index of words in vocabulary
+// * vocab_index - open addressing hash table (size: vocab_index_size, sized to the vocab)
+// *** each bucket keeps the index of a word in vocabulary, with its hash and first chars
+// * vocab_arena - the strings of all the words, one after another
+// *** the hash table, arenas and the tokenizer are in vocab.h, shared with word2phrase
 // * table - the coolection of integers (??)
+// * alias_table - the same distribution of negatives in vocab_size entries (Walker alias method)
 // * model data structure
 // * syn0 - collection of real values (features of words as flattend) 
 // * syn1, syn1neg, 
 // * expTable - exponetial table for speed-up of sigmoid calculation
 
+#define _GNU_SOURCE // pthread_setaffinity_np
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include "vocab.h"
+#include "model.h"
+#include "hnsw.h"
+#include "tile.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
-#define MAX_STRING 100
 #define EXP_TABLE_SIZE 1000
 #define MAX_EXP 6
 #define MAX_SENTENCE_LENGTH 1000
-#define MAX_CODE_LENGTH 40
+#define MAX_CODE_LENGTH 64 // bits of a packed code
 
-// Maximum 30 * 0.7 = 21M words in the voc 
+// Maximum 30 * 0.7 = 21M words in the voc (ReduceVocab keeps it below)
 const int vocab_hash_size = 30000000; 
 
 // Precision of float numbers
 typedef float real;
 
-struct vocab_word {
-	long long cn; // word count, read from vocab file or counted from train
-	int * point; // binary tree edges
-	char *word, *code, codelen; // word: the string, code: binary tree code, codelen: depth (len of code)
+// binary (Huffman) tree paths of all the words, see CreateBinaryTree
+// * tree_offset[a] .. tree_offset[a + 1] - the range of word a in tree_points,
+//   the length is the depth of a (len of its code)
+// * tree_points - the inner nodes (rows of syn1) on the paths from the root
+// * tree_codes - the codes, bit d of tree_codes[a] is the branch taken at tree_points[tree_offset[a] + d]
+long long * tree_offset = NULL;
+int * tree_points = NULL;
+unsigned long long * tree_codes = NULL;
+// while building: the parent of every node (leaves 0..vocab_size-1, then
+// the inner nodes) and the branch (0/1) that leads from the parent to it
+int * tree_parent;
+char * tree_branch;
+
+// header of a -save-tree file, followed by tree_offset, tree_codes and tree_points
+struct tree_header {
+	char magic[8]; // "W2VTREE"
+	long long vocab_size;
+	long long vocab_checksum; // VocabChecksum() of the vocab the tree was built for
+	long long points; // tree_offset[vocab_size]
 };
 
 char train_file[MAX_STRING], output_file[MAX_STRING];
 char save_vocab_file[MAX_STRING], read_vocab_file[MAX_STRING];
+char save_ids_file[MAX_STRING], read_ids_file[MAX_STRING];
+char report_file[MAX_STRING];
+char save_tree_file[MAX_STRING], read_tree_file[MAX_STRING];
+// precision - significant digits of the text output, 0 is the shortest that reads back the same float
+int precision = 0;
+// hnsw_m - links per node of the HNSW index written next to the output (0 - none),
+// hnsw_ef - candidates kept while it is built
+int hnsw_m = 0, hnsw_ef = 200;
+// k-means of -classes: kmeans_iter - most iterations, kmeans_tol - stop when at most this
+// fraction of the words change class, kmeans_batch - words of a mini-batch (0 - all the words)
+int kmeans_iter = 10;
+float kmeans_tol = 0.001;
+long long kmeans_batch = 0;
 
 // vocab table
 struct vocab_word *vocab;
 // flags: cbow = cbow architecture
 int binary = 0, cbow = 0, debug_mode = 2;
 int window = 5, min_count = 5; /*min counts for word from vocab to stay in vocab*/ 
+int iter = 1; /*number of passes (epochs) over the train file*/
 int num_threads = 1, min_reduce = 1; /*min counts for word from train to stay in vocab*/
 
-int * vocab_hash;
+// the table is a power of 2, and grows to keep the load under 0.7
+struct vocab_bucket * vocab_index = NULL;
+long long vocab_index_size = 0;
+// one contiguous block holding all the words (0-terminated)
+char * vocab_arena = NULL;
+long long arena_size = 0, arena_max = 0;
 
 long long vocab_max_size = 1000, vocab_size = 0, layer1_size = 100;
 long long train_words = 0, word_count_actual = 0, file_size = 0, classes = 0;
 real alpha = 0.025, starting_alpha, sample = 0;
-real *syn0, *syn1, *syn1neg, *expTable;
-clock_t start;
+// keep_threshold - with -sample, a word is kept if 16 random bits are <= its threshold
+unsigned int * keep_threshold = NULL;
+// the weights - rows of layer1_size values of weight_size bytes each, real
+// (float) or with -storage 16 bit bf16 / fp16 during training, see WEIGHT;
+// syn0 is widened back to real once training is done
+void *syn0, *syn1, *syn1neg;
+real *expTable;
+int storage = 0;
+long long weight_size = sizeof(real);
+// the weights from the offset off = row * layer1_size + column on
+#define WEIGHT(m, off) ((void *)((char *)(m) + (off) * weight_size))
+// wall clock start of training (clock() would add up the cpu time of all threads)
+struct timespec start;
+
+// training progress - every thread counts its trained words in its own
+// cache line, so the threads never write to the same line in the hot loop,
+// the sum (see UpdateProgress) drives progress, throughput and alpha
+struct progress_counter {
+	long long words;
+	char pad[64 - sizeof(long long)];
+};
+struct progress_counter * progress;
+
+// CHECKPOINTS - every thread publishes where it is at the start of each
+// sentence, every checkpoint_interval seconds a forked child writes the
+// (copy-on-write) weights and those states to checkpoint_file
+// * thread_state - what a thread needs to carry on, in TrainModelThread terms
+// * thread_checkpoint - two slots, the thread fills the other one and then
+//   flips current, so a snapshot never sees a half written state
+// the weights are those at the fork and the states those at the start of the sentence
+// each thread was in, so a resumed run trains that part of the sentence again - it
+// carries on the same streams (positions, next_random, round_state) but is not
+// bit-exact with a run that was never stopped
+struct thread_state {
+	long long pos, start_pos;
+	long long word_count, last_word_count, words_done;
+	long long local_iter; // epochs left, 0 once the thread is done
+	unsigned long long next_random;
+	unsigned int round_state[8]; // the stochastic rounding of -storage 1 / 2, see RoundBF16
+};
+struct thread_checkpoint {
+	struct thread_state slot[2];
+	int current;
+	char pad[256 - 2 * sizeof(struct thread_state) - sizeof(int)];
+};
+struct thread_checkpoint * thread_checkpoints;
+// the states read by -resume, NULL for a fresh start
+struct thread_state * resume_states = NULL;
+long long resume_words = 0;
+// header of a checkpoint file, followed by num_threads thread_states,
+// then syn0, syn1 (hs) and syn1neg (negative)
+struct checkpoint_header {
+	char magic[8]; // "W2VCKPT"
+	long long vocab_size, vocab_checksum, layer1_size;
+	long long hs, negative, num_threads, iter, storage;
+	long long words; // trained so far by all the threads
+	// the input the thread positions are offsets in: text (ids 0) or -read-ids (1,
+	// ids_width), and its size in bytes
+	long long ids, ids_width, file_size;
+};
+char checkpoint_file[MAX_STRING], resume_file[MAX_STRING];
+int checkpoint_interval = 600;
+int threads_done = 0;
+pid_t checkpoint_pid = 0;
+
+// wall time of the phases of TrainModel, for -report
+double vocab_secs = 0, tree_secs = 0, init_secs = 0, train_secs = 0, save_secs = 0;
+
+// the training file is memory-mapped once and shared read-only by all threads,
+// words are tokenized directly over the mapped bytes (see ReadWordMapped)
+char * train_data = NULL;
+
+// pre-encoded corpus (-save-ids / -read-ids, see struct ids_header): in this mode
+// ids_data points to the stream and file_size is its length in bytes
+int ids_width = 0;
+unsigned char * ids_data = NULL;
 
 // unigram table - hashing the unigram in vocab table
-int hs = 1, negative = 0;
+// batch_negative - skip-gram shares one set of negatives across the window
+int hs = 1, negative = 0, batch_negative = 0;
+// numa - 1: pin the threads to cpus and spread the weights over the nodes by
+// first touch from the pinned threads, 2: interleave the weights page by page instead
+int numa = 0;
+// seed - of the initial syn0 values
+unsigned long long seed = 1;
+int * cpu_list = NULL, cpu_count = 0;
 const int table_size = 1e8;
 int * table;
+// unigram_table - sample the negatives from the 400MB table above instead
+// of the alias table, O(vocab_size), of the same unigram^0.75 distribution
+int unigram_table = 0;
+struct alias_entry {
+	unsigned int prob; // keep the bucket's own word if the 24 bit coin is below
+	int alias; // the other word of the bucket
+} * alias_table;
 
 // initialize unigram table
 void InitUnigramTable() {
@@ -116,6 +257,89 @@ void InitUnigramTable() {
 	}
 }
 
+void InitKeepThresholds() {
+	// the subsampling probability of every word, computed once instead of per token
+	long long a;
+	real ran;
+	keep_threshold = (unsigned int *)malloc(vocab_size * sizeof(unsigned int));
+	if (keep_threshold == NULL) {
+		printf("Memory allocation failed\n");
+		exit(1);
+	}
+	for (a = 0; a < vocab_size; a++) {
+		ran = (sqrt(vocab[a].cn / (sample * train_words)) + 1) * (sample * train_words) / vocab[a].cn;
+		// kept when ran >= (next_random & 0xFFFF) / 65536
+		keep_threshold[a] = (ran >= 1) ? 0xFFFF : (unsigned int)(ran * 65536);
+	}
+}
+
+void InitAliasTable() {
+	// Walker's alias method (Vose's construction): vocab_size buckets of
+	// equal probability, each split between its own word and one alias,
+	// so that a negative takes one random bucket and one coin flip
+	long long a, n_small = 0, n_large = 0, l, g;
+	double train_words_pow = 0, power = 0.75;
+	double * p = (double *)malloc(vocab_size * sizeof(double));
+	long long * small = (long long *)malloc(vocab_size * sizeof(long long));
+	long long * large = (long long *)malloc(vocab_size * sizeof(long long));
+	alias_table = (struct alias_entry *)malloc(vocab_size * sizeof(struct alias_entry));
+	if (p == NULL || small == NULL || large == NULL || alias_table == NULL) {
+		printf("Memory allocation failed\n");
+		exit(1);
+	}
+	for (a = 0; a < vocab_size; a++) {
+		p[a] = pow(vocab[a].cn, power);
+		train_words_pow += p[a];
+	}
+	// p - probability times vocab_size, buckets below 1 get topped up by words above 1
+	for (a = 0; a < vocab_size; a++) {
+		p[a] = p[a] * vocab_size / train_words_pow;
+		if (p[a] < 1) small[n_small++] = a; else large[n_large++] = a;
+	}
+	while (n_small > 0 && n_large > 0) {
+		l = small[--n_small];
+		g = large[n_large - 1];
+		alias_table[l].prob = (unsigned int)(p[l] * (1 << 24));
+		alias_table[l].alias = g;
+		p[g] -= 1 - p[l];
+		if (p[g] < 1) {
+			n_large--;
+			small[n_small++] = g;
+		}
+	}
+	// what is left is 1 up to rounding
+	while (n_large > 0) {
+		g = large[--n_large];
+		alias_table[g].prob = 1 << 24;
+		alias_table[g].alias = g;
+	}
+	while (n_small > 0) {
+		l = small[--n_small];
+		alias_table[l].prob = 1 << 24;
+		alias_table[l].alias = l;
+	}
+	free(p);
+	free(small);
+	free(large);
+}
+
+// draws a negative example, with the random state of the calling thread
+static inline long long SampleNegative(unsigned long long * next_random) {
+	long long target;
+	struct alias_entry e;
+	*next_random = *next_random * (unsigned long long)25214903917 + 11;
+	if (unigram_table) target = table[(*next_random >> 16) % table_size];
+	else {
+		// high 32 bits pick the bucket, the 24 bits below them are the coin
+		target = ((*next_random >> 32) * (unsigned long long)vocab_size) >> 32;
+		e = alias_table[target];
+		if (((*next_random >> 8) & 0xFFFFFF) >= e.prob) target = e.alias;
+	}
+	// </s> is never a negative example
+	if (target == 0) target = *next_random % (vocab_size - 1) + 1;
+	return target;
+}
+
 void ReadWord(char * word, FILE * fin) {
 	// Reads a single word from a file
 	// assuming SPACE + TAB + EOL to be word boundaries
@@ -142,21 +366,22 @@ void ReadWord(char * word, FILE * fin) {
 	word[a] = 0;
 }
 
-int GetWordHash(char * word) {
-	unsigned long long a, hash = 0;
-	// 257 - the smallest prime greater than 255 (1 byte)
-	for (a = 0; a < strlen(word); a++)
-		hash = hash * 257 + word[a];
-	hash = hash % vocab_hash_size;
-	return hash;
+// Maps the whole training file into memory and sets file_size
+void MapTrainFile() {
+	train_data = MapFile(train_file, &file_size);
+	if (file_size < 0) {
+		printf("ERROR: training data file not found!\n");
+		exit(1);
+	}
 }
 
-int AddWordToVocab(char * word) {
-	// Adds a word to the vocabulary
-	unsigned int hash, length = strlen(word) + 1;
-	if (length > MAX_STRING) length = MAX_STRING; // Truncation
-	vocab[vocab_size].word = (char *) calloc(length, sizeof(char));
-	strcpy(vocab[vocab_size].word, word);
+int AddWordToVocab(char * word, int len) {
+	// Adds a word (len chars, not necessarily 0-terminated) to the vocabulary
+	unsigned int hash;
+	long long b;
+	if (len > MAX_STRING - 1) len = MAX_STRING - 1; // Truncation
+	vocab[vocab_size].word = ArenaAdd(&vocab_arena, &arena_size, &arena_max, vocab, vocab_size, word, len);
+	vocab[vocab_size].len = len;
 	// cn are initialized to 0s because
 	// it will be read later from the vocabulary file
 	vocab[vocab_size].cn = 0;
@@ -166,79 +391,57 @@ int AddWordToVocab(char * word) {
 		vocab_max_size += 1000;
 		vocab = (struct vocab_word *) realloc(vocab, vocab_max_size * sizeof(struct vocab_word));
 	}
-	// hashing value for the current word
-	hash = GetWordHash(word);
-	// increase hash by 1 until it finds an empty slot in vocab_hash !!
-	// Potetially, if the size of vocab_hash is smaller than the size of vocab
-	// it could never find an empty slot
-	// vocab_hash was intialized earlier in ReadVocab()
-	while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-	vocab_hash[hash] = vocab_size - 1;
+	// keep the load of the table under 0.7
+	if (vocab_size > vocab_index_size * 0.7) ResizeIndex(&vocab_index, &vocab_index_size, vocab_index_size * 2);
+	// the empty bucket for the word - linear probing from its hash
+	hash = GetWordHash(word, len);
+	b = FindBucket(vocab_index, vocab_index_size, vocab, word, len, hash, GetWordKey(word, len));
+	vocab_index[b].hash = hash;
+	vocab_index[b].key = GetWordKey(word, len);
+	vocab_index[b].index = vocab_size - 1;
 	return vocab_size - 1;
 }
 
-int VocabCompare(const void * a, const void * b) {
-	// comparing words by their word counts
-	return ((struct vocab_word * )b)->cn - ((struct vocab_word * )a)->cn;
-}
-
 void SortVocab() {
 	// Sorts the vocabulary by frequency using word counts
 	int a, size;
-	unsigned int hash;
+	char * arena;
 	// sort the vocabulary and keep </s> at the first position
 	// in Decreasing order
 	qsort(&vocab[1], vocab_size-1, sizeof(struct vocab_word), VocabCompare);
-	// vocab_hash was earlier initialized in ReadVocab()
-	// and it is REinitialized here to be -1 BECAUSE we are
-	// sorting the words and invalidating their previous index
-	for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
 	size = vocab_size; // because vocab_size changes along the loop
 	train_words = 0;
 	// OUTPUT OF THE LOOP: ALL INFREQUNET WORDS DELETED, vocab_size, and
 	// train_words size are all correct
+	// words occuring less than min_count times will be discared from the vocab,
+	// they are all in the rear after sorting. </s> always stays at the first position
 	for (a = 0; a < size; a++) {
-		// words occuring less than min_count times will be discared from the vocab
-		// BUT HERE </s> WILL STILL REMAIN - because the words are removed from
-		// the end of vocab
-		// AND </s> IS NOT HASHED IN vocab_hash -- its index is still -1
-		if (vocab[a].cn < min_count) {
-			vocab_size--;
-			// NOT vocab[a].word but vocab[vocab_size].word ?? A BUG ??
-			// NO actually it works here because the words are now
-			// sorted in a decreasing order (wrt word counts), so after 
-			// finding the first occurance of < min_count, all the
-			// occurances should just be behind it.
-			free(vocab[vocab_size].word);
-		} else {
-			// hash will be re-computed, as after the sorting it is not valid anymore
-			// why recomputing of the word hash is needed???
-			// as hashing of the word is based on the string itself and vocab_hash_size, and has
-			// nothing to do with the index of the word in the vocab
-			// SO THE ONLY REASON why "hash" is needed again (because it is not stored previously),
-			// is that now the hash table is filled as MOST_FREQUENT_WORD_TAKES_PRIORITY (empty slot)
-			// compared to previously FIRST_COMING_WORD_TAKES_PRIORITY in AddWordToVocab()
-			hash = GetWordHash(vocab[a].word);
-			while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-			vocab_hash[hash] = a;
-			train_words += vocab[a].cn;
-			// BUT AS A RESULT, the word index used in the vocab_hash are the same
-			// index (after sorted by word counts) AS IF the infrequent words ARE 
-			// STILL IN VOCAB ??? 
-			// NO it works, because all the words discarded are in the rear
-			// of the list, so the index in vocab_hash ARE CONSISTENT with 
-			// the index in vocab, see comments above as well.
+		if ((a > 0) && (vocab[a].cn < min_count)) {
+			vocab_size = a;
+			break;
 		}
+		train_words += vocab[a].cn;
 	}
+	// copy the words left into a new arena, in the sorted order - the frequent
+	// words are then next to each other
+	arena_max = 0;
+	for (a = 0; a < vocab_size; a++) arena_max += vocab[a].len + 1;
+	arena = (char *)malloc(arena_max + 1);
+	arena_size = 0;
+	for (a = 0; a < vocab_size; a++) {
+		memcpy(arena + arena_size, vocab[a].word, vocab[a].len + 1);
+		vocab[a].word = arena + arena_size;
+		arena_size += vocab[a].len + 1;
+	}
+	free(vocab_arena);
+	vocab_arena = arena;
+	// hash table is rebuilt because sorting invalidated the indices,
+	// it is sized for the final vocab
+	BuildIndex(&vocab_index, &vocab_index_size, vocab, vocab_size);
 	// now it makes sense to make the vocab table shrink 
 	// by just free the rear part of the table
 	// MUST BE VOCAB_SIZE + 1 because </s> is there
 	vocab = (struct vocab_word *)realloc(vocab, (vocab_size+1) * sizeof(struct vocab_word));
-	// prepare memory for binary tree construction
-	for (a = 0; a < vocab_size; a++) {
-		vocab[a].code = (char *)calloc(MAX_CODE_LENGTH, sizeof(char));
-		vocab[a].point = (int *)calloc(MAX_CODE_LENGTH, sizeof(int));
-	}
 }
 
 void ReadVocab() {
@@ -251,19 +454,19 @@ void ReadVocab() {
 		exit(1);
 	}
 	// initiliaze the hash table -1 for all words
-	for (a = 0; a < vocab_hash_size; a++)
-		vocab_hash[a] = -1;
 	vocab_size = 0;
+	arena_size = 0;
+	BuildIndex(&vocab_index, &vocab_index_size, vocab, 0);
 	// read all the words, and their counts from the file
-	// add them in the vocab, add their index to vocab_hash
+	// add them in the vocab, add their index to vocab_index
 	// i number of words in vocab
 	while (1) {
 		ReadWord(word, fin);
 		if (feof(fin)) break;
 		// suppose the words in vocab are already unique
 		// add word structure to vocab,
-		// put their index in vocab in vocab_hash
-		a = AddWordToVocab(word); // index of the word in vocab
+		// put their index in vocab in vocab_index
+		a = AddWordToVocab(word, strlen(word)); // index of the word in vocab
 		// swallow c - the new line "\n"
 		fscanf(fin, "%lld%c", &vocab[a].cn, &c);
 		i++;
@@ -274,101 +477,125 @@ void ReadVocab() {
 		printf("Vocab size: %lld\n", vocab_size);
 		printf("Words in train file: %lld\n", train_words);
 	}
-	fin = fopen(train_file, "rb");
-	if (fin == NULL) {
-		printf("ERROR: training data file not found!\n");
-		exit(1);
-	}
-	fseek(fin, 0, SEEK_END);
-	file_size = ftell(fin);
 	fclose(fin);
+	// with -read-ids the train file is not needed, see MapIdsFile
+	if (read_ids_file[0] == 0) MapTrainFile();
 }
 
-int SearchVocab(char * word) {
-	unsigned int hash = GetWordHash(word);
-	while (1) {
-		// no found
-		if (vocab_hash[hash] == -1) return -1; 
-		// return hit index
-		if (!strcmp(word, vocab[vocab_hash[hash]].word)) return vocab_hash[hash];
-		// keep searching when no hit and no miss yet 
-		hash = (hash + 1) % vocab_hash_size;
-	}
-	return -1; // never reach here
+int SearchVocab(char * word, int len) {
+	// index of the word (len chars, not 0-terminated), -1 if not found
+	unsigned int hash = GetWordHash(word, len);
+	long long b = FindBucket(vocab_index, vocab_index_size, vocab, word, len, hash, GetWordKey(word, len));
+	return vocab_index[b].index;
 }
 
 void ReduceVocab() {
 	// reduces the vocabulary by removing infrequent tokens.
 	int a, b = 0;
-	unsigned int hash;
 	// The in-place removal code is FANTASTIC!!
 	for (a = 0; a < vocab_size; a++) {
 		if (vocab[a].cn > min_reduce) {
-			vocab[b].cn = vocab[a].cn;
-			vocab[b].word = vocab[a].word;
+			vocab[b] = vocab[a];
 			b++;
-		} else {
-			free (vocab[a].word);
 		}
 	}
 	vocab_size = b;
-	// reset the hash table
-	for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
-	for (a = 0; a < vocab_size; a++) {
-		// Hash will be re-computed, as it is not actual
-		hash = GetWordHash(vocab[a].word);
-		while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-		vocab_hash[hash] = a;
-	}
+	// the strings of the removed words are squeezed out of the arena
+	CompactArena(vocab_arena, &arena_size, vocab, vocab_size);
+	// reset the hash table, hash will be re-computed
+	BuildIndex(&vocab_index, &vocab_index_size, vocab, vocab_size);
 	fflush(stdout);
 	// Incerease the threshold next time
 	// so it wont be a for-ever loop twisted with LearnVocabFromTrainFile
 	min_reduce++;
 }
 
+// the counting state of every thread for the parallel vocabulary pass (see struct vocab_shard)
+struct vocab_shard * shards;
+// words counted by all threads so far, for the progress display only
+long long vocab_words_done = 0;
+// entries in all the shards, see ShardCheckLimit
+long long vocab_shard_total = 0;
+
+void * LearnVocabThread(void * id) {
+	// counts the words of one chunk, a chunk is split at the byte offset
+	// the same way TrainModelThread splits the file
+	struct vocab_shard * sh = &shards[(long long)id];
+	long long pos = ShardStart(train_data, file_size, sh->start), done, size;
+	char buf[MAX_STRING], * word, ch;
+	int len;
+	while (1) {
+		// skip blanks to find where the next word starts - words (and the
+		// </s> of a new line) that start past the end belong to the next chunk
+		while (pos < sh->end) {
+			ch = train_data[pos];
+			if ((ch != ' ') && (ch != '\t') && (ch != 13)) break;
+			pos++;
+		}
+		if (pos >= sh->end) break;
+		len = ReadWordMapped(train_data, file_size, &word, &pos, buf);
+		if (len < 0) break;
+		sh->words++;
+		if ((sh->words % 100000) == 0) {
+			done = __sync_add_and_fetch(&vocab_words_done, 100000);
+			if (debug_mode > 1) {
+				printf("%lldK%c", done / 1000, 13);
+				fflush(stdout);
+			}
+		}
+		size = sh->size;
+		ShardAddWord(sh, word, len, 1);
+		// the whole vocab limit is shared between the threads
+		ShardCheckLimit(sh, sh->size - size, &vocab_shard_total, vocab_hash_size * 0.7, num_threads, &min_reduce);
+	}
+	pthread_exit(NULL);
+}
+
 void LearnVocabFromTrainFile() {
-	char word[MAX_STRING];
-	FILE * fin;
-	long long a, i;
+	long long a, i, t;
+	pthread_t * pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+	struct vocab_shard * sh;
 	// initialize hash table as all -1s
-	for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
-	fin = fopen(train_file, "rb");
-	if (fin == NULL) {
-		printf("ERROR: training data file not found!\n");
-		exit(1);
-	}
+	BuildIndex(&vocab_index, &vocab_index_size, vocab, 0);
+	// also sets file_size
+	MapTrainFile();
 	vocab_size = 0;
 	// always add </s> as the first one - otherwise SortVocab will be wrong
 	// THis is consistent with ReadVocab()
-	AddWordToVocab((char *)"</s>");
-	while (1) {
-		// WILL INSERT </S> FOR EACH NEW LINE
-		ReadWord(word, fin);
-		// ReadWord, but no fscanf(fin, "%lld%c", ...); as in ReadVocab file
-		if (feof(fin)) break;
-		train_words++;
-		if ((debug_mode > 1) && (train_words % 100000 == 0)) {
-			printf("%lldK%c", train_words / 1000, 13);
-			fflush(stdout);
-		}
-		// find the index of word in vocab by searching in vocab_hash
-		i = SearchVocab(word);
-		// no found in vocab - add to vocab and vocab_hash, set word.cn = 1
-		// found in vocab - update word.cn += 1
-		if (i == -1) {
-			a = AddWordToVocab(word);
-			vocab[a].cn = 1;
-		} else vocab[i].cn++;
-		// vocab is too LARGE for the current vocab_hash_table
-		if (vocab_size > vocab_hash_size * 0.7) ReduceVocab();
+	AddWordToVocab((char *)"</s>", 4);
+	// count in parallel, one chunk of the file per thread
+	vocab_shard_total = 0;
+	shards = (struct vocab_shard *)calloc(num_threads, sizeof(struct vocab_shard));
+	for (t = 0; t < num_threads; t++) {
+		sh = &shards[t];
+		InitShard(sh);
+		sh->start = file_size / num_threads * t;
+		sh->end = (t == num_threads - 1) ? file_size : file_size / num_threads * (t + 1);
+		pthread_create(&pt[t], NULL, LearnVocabThread, (void *)t);
 	}
+	for (t = 0; t < num_threads; t++) pthread_join(pt[t], NULL);
+	// merge the chunks IN ORDER - words are then added in the order they first
+	// appear in the file, so the vocab comes out the same as with a single thread
+	// (as long as the counting did not have to reduce, see ShardCheckLimit)
+	for (t = 0; t < num_threads; t++) {
+		sh = &shards[t];
+		train_words += sh->words;
+		for (a = 0; a < sh->size; a++) {
+			i = SearchVocab(sh->vocab[a].word, sh->vocab[a].len);
+			if (i == -1) i = AddWordToVocab(sh->vocab[a].word, sh->vocab[a].len);
+			vocab[i].cn += sh->vocab[a].cn;
+			// vocab is too LARGE for the current vocab_hash_table
+			if (vocab_size > vocab_hash_size * 0.7) ReduceVocab();
+		}
+		FreeShard(sh);
+	}
+	free(shards);
+	free(pt);
 	SortVocab();
 	if (debug_mode > 0) {
 		printf("Vocab size: %lld\n", vocab_size);
 		printf("Words in train file: %lld\n", train_words);
 	}
-	file_size = ftell(fin);
-	fclose(fin);
 }
 
 void SaveVocab() {
@@ -381,153 +608,1161 @@ void SaveVocab() {
 	fclose(fo);
 }
 
+void *CreateTreeThread(void *id) {
+	// fills the paths of this thread's range of leaves, walking up from
+	// each leaf and writing its path from the end - the root comes first
+	long long a0 = vocab_size / num_threads * (long long)id;
+	long long a1 = ((long long)id == num_threads - 1) ? vocab_size : a0 + vocab_size / num_threads;
+	long long a, d;
+	int b;
+	unsigned long long code;
+	for (a = a0; a < a1; a++) {
+		code = 0;
+		b = a;
+		for (d = tree_offset[a + 1] - tree_offset[a] - 1; d >= 0; d--) {
+			code |= (unsigned long long)tree_branch[b] << d;
+			b = tree_parent[b];
+			// point - relative index of parent from vocab_size, the root is vocab_size - 2
+			tree_points[tree_offset[a] + d] = b - vocab_size;
+		}
+		tree_codes[a] = code;
+	}
+	pthread_exit(NULL);
+}
+
 void CreateBinaryTree() {
 	//Create binary Huffman tree using the word counts
 	// Frequent words will have short unique binary codes
-	long long a, b, i;
-	long long min1i, min2i; // two smallest nodes
-	long long pos1, pos2; // current pivots
-	long long point[MAX_CODE_LENGTH];
-	char code[MAX_CODE_LENGTH];
-	// calloc initializes the memory to zeros
-	// SHOULD IT BE vocab_size * 2 - 1 - this is because
-	// it seems that </s> is in part of construction, but vocab_size is 
-	// actually len(vocab)-1, excluding </s>
-	long long *count = (long long *)calloc(vocab_size * 2 + 1, sizeof(long long));
-	long long *binary = (long long *)calloc(vocab_size * 2 + 1, sizeof(long long));
-	long long *parent_node = (long long *)calloc(vocab_size * 2 + 1, sizeof(long long));
-	// count - word counts of all words
-	for (a = 0; a < vocab_size; a++) count[a] = vocab[a].cn;
-	// extend count as twice large
-	// SO ONLY vocab_size * 2 - 1 elements will BE NEEDED, EVEN FOR A 
-	// COMPLETE TREE
-	for (a = vocab_size; a < vocab_size * 2; a++) count[a] = 1e15;
-	// initialize the node positions
-	pos1 = vocab_size - 1; 
-	pos2 = vocab_size;
-	// following algorithm constructs the Huffman tree by
-	// adding one node at a time
-	// the vocab should have been sorted IN DECREASING order
-	// pos1 and pos2 will be the two current smallest node 
-	// they could be the original elements, they could be composed parent nodes
-	// the parents node will be constructed and placed along the array
-	// from [vocab_size to vocab_size * 2 - 1].
-	// THE GOOD THING IS: the elements on the left of pos1 are all SORTED, 
-	// and the elements on the right of pos2 will also be SORTED.
-
+	long long a, pos1, pos2; // current pivots
+	int min1i, min2i; // two smallest nodes
+	int root = vocab_size * 2 - 2;
+	pthread_t * pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+	// inner - the counts of the vocab_size - 1 inner nodes, the leaves' counts are in vocab
+	// depth - of every node, the root is 0
+	long long * inner = (long long *)malloc(vocab_size * sizeof(long long));
+	int * depth = (int *)malloc(vocab_size * 2 * sizeof(int));
+	tree_parent = (int *)malloc(vocab_size * 2 * sizeof(int));
+	tree_branch = (char *)calloc(vocab_size * 2, sizeof(char));
+	tree_offset = (long long *)malloc((vocab_size + 1) * sizeof(long long));
+	tree_codes = (unsigned long long *)malloc(vocab_size * sizeof(unsigned long long));
+	if (inner == NULL || depth == NULL || tree_parent == NULL || tree_branch == NULL || tree_offset == NULL || tree_codes == NULL) {
+		printf("Memory allocation failed\n");
+		exit(1);
+	}
+	// not created yet - larger than any count
+	for (a = 0; a < vocab_size; a++) inner[a] = 1e15;
+#define NODE_COUNT(n) ((n) < vocab_size ? vocab[n].cn : inner[(n) - vocab_size])
+	// the Huffman tree in linear time: the vocab is sorted IN DECREASING order,
+	// so the two smallest nodes are always at one of two pivots - pos1 moves
+	// left over the leaves, pos2 moves right over the inner nodes, which are
+	// created in increasing order of count (at vocab_size + a)
 	// THE LAST WORD </s> WILL ALSO BE INCLUDED IN THE TREE
-	// ONLY NEED TO CONSTRUCT vocab_size - 1 times, that is max number 
-	// of parent nodes for a complete binary tree
+	pos1 = vocab_size - 1;
+	pos2 = vocab_size;
 	for (a = 0; a < vocab_size - 1; a++) {
 		// First, find two smallest nodes "min1, min2"
-		// MIN1 goes first
-		if (pos1 >= 0) {
-			if (count[pos1] < count[pos2]) { // move left via pos1
-				min1i = pos1;
-				pos1--;
-			} else { // move right via pos2
-				min1i = pos2;
-				pos2++;
-			}
-		} else { // no choice, can move right ONLy now
-			min1i = pos2;
-			pos2++;
-		}
-		// MIN2 goes next
-		if (pos1 >= 0) {
-			if (count[pos1] < count[pos2]) { // move left via pos1
-				min2i = pos1;
-				pos1--;
-			} else { // move right via pos2
-				min2i = pos2;
-				pos2++;
-			}
-		} else {
-			min2i = pos2;
-			pos2++;
-		}
+		if ((pos1 >= 0) && (NODE_COUNT(pos1) < NODE_COUNT(pos2))) min1i = pos1--; else min1i = pos2++;
+		if ((pos1 >= 0) && (NODE_COUNT(pos1) < NODE_COUNT(pos2))) min2i = pos1--; else min2i = pos2++;
 		// parent's count is the sum of children's counts
-		count[vocab_size + a] = count[min1i] + count[min2i];
-		// commmon parents
-		// level 2 parents will be from vocab_size to vocab_size * 2
-		parent_node[min1i] = vocab_size + a;
-		parent_node[min2i] = vocab_size + a;
-		// binary code: min1i 0 min2i 1, for each leaf and internal node
-		binary[min2i] = 1;
-	}
-	// now assign binary code to each vocabulary word
-	// update each vocab word and its parent
+		inner[a] = NODE_COUNT(min1i) + NODE_COUNT(min2i);
+		tree_parent[min1i] = vocab_size + a;
+		tree_parent[min2i] = vocab_size + a;
+		// binary code: min1i 0 min2i 1
+		tree_branch[min2i] = 1;
+	}
+#undef NODE_COUNT
+	// depths top-down - a parent always has a larger index than its children
+	depth[root] = 0;
+	for (a = root - 1; a >= 0; a--) depth[a] = depth[tree_parent[a]] + 1;
+	// lay out the paths one after another in tree_points
+	tree_offset[0] = 0;
 	for (a = 0; a < vocab_size; a++) {
-		b = a;
-		i = 0;
-		// upstreaming to parent of each leave (a) and its parent (b)
-		// to update their code and point - they are temprory structure
-		// whose max length is the tranverse length
-		// * point is an array of indices in count, in an the order of 
-		//   traversing the tree from each leaf to its parents up to the root
-		// * code is an array 
-		while (1) {
-			code[i] = binary[b];
-			point[i] = b;
-
-			i++; // the depth of traverse from leaf to root
-			b = parent_node[b];
-			if (b == vocab_size * 2 - 2) break;
-		}
-		vocab[a].codelen = i; // depth
-		// point - relative index of parent from vocab_size+1
-		// in reverse order - path from root to the current word (leaf node)
-		vocab[a].point[0] = vocab_size - 2; 
-		for (b = 0; b < i; b++) {
-			vocab[a].code[i - b - 1] = code[b];
-			vocab[a].point[i - b] = point[b] - vocab_size; // parent node index
-		}
-	}
-	free(count);
-	free(binary);
-	free(parent_code);
-}
-
-int ReadWordIndex(FILE * fin) {
-	// Reads a word and returns its index in the vocabulary
-	char word[MAX_STRING];
-	ReadWord(word, fin);
-	if (feof(fin)) return -1;
-	return SearchVocab(word);
+		if (depth[a] > MAX_CODE_LENGTH) {
+			printf("ERROR: the code of %s is longer than %d bits\n", vocab[a].word, MAX_CODE_LENGTH);
+			exit(1);
+		}
+		tree_offset[a + 1] = tree_offset[a] + depth[a];
+	}
+	tree_points = (int *)malloc(tree_offset[vocab_size] * sizeof(int));
+	if (tree_points == NULL) {
+		printf("Memory allocation failed\n");
+		exit(1);
+	}
+	for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, CreateTreeThread, (void *)a);
+	for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+	free(pt);
+	free(inner);
+	free(depth);
+	free(tree_parent);
+	free(tree_branch);
+}
+
+int ReadWordIndex(long long * pos, char * buf) {
+	// Reads a word from the mapped file and returns its index in the vocabulary
+	// -1 if it is not in the vocabulary, -2 at the end of file
+	char * word;
+	int len = ReadWordMapped(train_data, file_size, &word, pos, buf);
+	if (len < 0) return -2;
+	return SearchVocab(word, len);
+}
+
+int ReadIdIndex(long long * pos) {
+	// Reads the next index from the pre-encoded stream, -2 at the end
+	// (the same contract as ReadWordIndex: an index that is not in the vocab,
+	// from a damaged stream, is -1 like an unknown word)
+	long long p = *pos;
+	unsigned int word = 0, shift = 0;
+	if (p >= file_size) return -2;
+	if (ids_width == 2) {
+		*pos = p + 2;
+		word = ((unsigned short *)(ids_data + p))[0];
+	} else if (ids_width == 4) {
+		*pos = p + 4;
+		word = ((unsigned int *)(ids_data + p))[0];
+	} else {
+		// varint - the high bit says "more bytes follow"
+		while (p < file_size) {
+			if (shift < 32) word |= (ids_data[p] & 0x7F) << shift;
+			shift += 7;
+			if (!(ids_data[p++] & 0x80)) break;
+		}
+		*pos = p;
+		if (shift > 35) return -1;
+	}
+	return (word < vocab_size) ? (int)word : -1;
+}
+
+long long IdsChunkStart(long long pos) {
+	// Moves a byte offset in the ids stream forward to the start of an index
+	// the chunks are byte ranges of the stream, not of the text, so with more than
+	// one thread every thread trains on other words than the same run from text and
+	// the vectors differ (with -threads 1 they are the same)
+	if (ids_width > 0) return pos - pos % ids_width;
+	while ((pos > 0) && (pos < file_size) && (ids_data[pos - 1] & 0x80)) pos++;
+	return pos;
+}
+
+void SaveIds() {
+	// Encodes the mapped train file with the current vocab - a one-time step,
+	// later runs train from the ids with -read-vocab + -read-ids
+	long long pos = 0, n = 0, a = 0;
+	struct ids_header h;
+	char buf[MAX_STRING];
+	int word;
+	unsigned char * out;
+	FILE * fo;
+	// checked before the file is opened, it is not truncated on an error (-ids-width in main)
+	if ((ids_width == 2) && (vocab_size > 65536)) {
+		printf("ERROR: vocab of %lld words does not fit in 16 bit indices\n", vocab_size);
+		exit(1);
+	}
+	// 1MB output buffer, flushed with one fwrite
+	out = (unsigned char *)malloc(1 << 20);
+	if (out == NULL) {
+		printf("Memory allocation failed\n");
+		exit(1);
+	}
+	fo = fopen(save_ids_file, "wb");
+	if (fo == NULL) {
+		printf("ERROR: cannot open %s!\n", save_ids_file);
+		exit(1);
+	}
+	memset(&h, 0, sizeof(h));
+	strcpy(h.magic, "W2VIDS1");
+	h.width = ids_width;
+	h.vocab_size = vocab_size;
+	h.vocab_checksum = VocabChecksum(vocab, vocab_size);
+	// header is rewritten at the end, when words and data_size are known
+	fwrite(&h, sizeof(h), 1, fo);
+	while (1) {
+		word = ReadWordIndex(&pos, buf);
+		if (word == -2) break;
+		if (word == -1) continue;
+		n++;
+		a += PutId(out + a, ids_width, word);
+		// room for at least one more varint
+		if (a > (1 << 20) - 8) {
+			fwrite(out, 1, a, fo);
+			h.data_size += a;
+			a = 0;
+		}
+	}
+	fwrite(out, 1, a, fo);
+	h.data_size += a;
+	h.words = n;
+	fseek(fo, 0, SEEK_SET);
+	fwrite(&h, sizeof(h), 1, fo);
+	fclose(fo);
+	free(out);
+	if (debug_mode > 0) printf("Saved %lld indices (%lld bytes) to %s\n", n, h.data_size, save_ids_file);
+}
+
+void MapIdsFile() {
+	// Maps the ids file for training, the stream replaces the text train file
+	struct ids_header h;
+	long long size;
+	char * data = MapFile(read_ids_file, &size);
+	if (size < 0) {
+		printf("ERROR: ids file not found!\n");
+		exit(1);
+	}
+	if (size < (long long)sizeof(h)) {
+		printf("ERROR: %s is not an ids file\n", read_ids_file);
+		exit(1);
+	}
+	memcpy(&h, data, sizeof(h));
+	if (strcmp(h.magic, "W2VIDS1") || (h.data_size != size - (long long)sizeof(h))) {
+		printf("ERROR: %s is not an ids file\n", read_ids_file);
+		exit(1);
+	}
+	// ReadIdIndex reads a whole index of a fixed width, the stream must hold whole indices
+	if (((h.width != 0) && (h.width != 2) && (h.width != 4)) || ((h.width > 0) && (h.data_size % h.width))) {
+		printf("ERROR: %s has an index width of %lld and %lld bytes of indices\n", read_ids_file, h.width, h.data_size);
+		exit(1);
+	}
+	if ((h.vocab_size != vocab_size) || (h.vocab_checksum != VocabChecksum(vocab, vocab_size))) {
+		printf("ERROR: %s was encoded with a different vocabulary\n", read_ids_file);
+		exit(1);
+	}
+	ids_width = h.width;
+	ids_data = (unsigned char *)data + sizeof(h);
+	file_size = h.data_size;
+}
+
+void SaveTree() {
+	// the paths of the tree, for later runs with the same vocab (-read-tree)
+	struct tree_header h;
+	FILE * fo = fopen(save_tree_file, "wb");
+	if (fo == NULL) {
+		printf("ERROR: cannot open %s!\n", save_tree_file);
+		exit(1);
+	}
+	memset(&h, 0, sizeof(h));
+	strcpy(h.magic, "W2VTREE");
+	h.vocab_size = vocab_size;
+	h.vocab_checksum = VocabChecksum(vocab, vocab_size);
+	h.points = tree_offset[vocab_size];
+	fwrite(&h, sizeof(h), 1, fo);
+	fwrite(tree_offset, sizeof(long long), vocab_size + 1, fo);
+	fwrite(tree_codes, sizeof(unsigned long long), vocab_size, fo);
+	fwrite(tree_points, sizeof(int), h.points, fo);
+	fclose(fo);
+}
+
+void ReadTree() {
+	// reads the paths instead of building the tree, they must belong to the same vocab
+	struct tree_header h;
+	long long a, size;
+	FILE * fin = fopen(read_tree_file, "rb");
+	if (fin == NULL) {
+		printf("ERROR: tree file not found!\n");
+		exit(1);
+	}
+	if ((fread(&h, sizeof(h), 1, fin) != 1) || strcmp(h.magic, "W2VTREE")) {
+		printf("ERROR: %s is not a tree file\n", read_tree_file);
+		exit(1);
+	}
+	if ((h.vocab_size != vocab_size) || (h.vocab_checksum != VocabChecksum(vocab, vocab_size))) {
+		printf("ERROR: %s was built for a different vocabulary\n", read_tree_file);
+		exit(1);
+	}
+	fseek(fin, 0, SEEK_END);
+	size = ftell(fin);
+	if ((h.points < 0) || (size != (long long)sizeof(h) + (vocab_size * 2 + 1) * 8 + h.points * 4)) {
+		printf("ERROR: %s is truncated\n", read_tree_file);
+		exit(1);
+	}
+	fseek(fin, sizeof(h), SEEK_SET);
+	tree_offset = (long long *)malloc((vocab_size + 1) * sizeof(long long));
+	tree_codes = (unsigned long long *)malloc(vocab_size * sizeof(unsigned long long));
+	tree_points = (int *)malloc(h.points * sizeof(int));
+	if (tree_offset == NULL || tree_codes == NULL || tree_points == NULL) {
+		printf("Memory allocation failed\n");
+		exit(1);
+	}
+	if ((fread(tree_offset, sizeof(long long), vocab_size + 1, fin) != vocab_size + 1) ||
+		(fread(tree_codes, sizeof(unsigned long long), vocab_size, fin) != vocab_size) ||
+		(fread(tree_points, sizeof(int), h.points, fin) != h.points)) {
+		printf("ERROR: cannot read %s\n", read_tree_file);
+		exit(1);
+	}
+	fclose(fin);
+	// training indexes syn1 with the paths as they are, so they must be the ones
+	// CreateBinaryTree would lay out - every path at most MAX_CODE_LENGTH long, one
+	// after another over all of tree_points, and only the vocab_size - 1 inner nodes
+	if (tree_offset[0] != 0) a = 0;
+	else for (a = 0; a < vocab_size; a++)
+		if ((tree_offset[a + 1] < tree_offset[a]) || (tree_offset[a + 1] - tree_offset[a] > MAX_CODE_LENGTH)) break;
+	if ((a < vocab_size) || (tree_offset[vocab_size] != h.points)) {
+		printf("ERROR: %s has broken path offsets\n", read_tree_file);
+		exit(1);
+	}
+	for (a = 0; a < h.points; a++) if ((tree_points[a] < 0) || (tree_points[a] >= vocab_size - 1)) {
+		printf("ERROR: %s has an inner node %d out of range\n", read_tree_file, tree_points[a]);
+		exit(1);
+	}
+}
+
+// VECTOR KERNELS for the per-dimension loops of training
+// (they are written for real == float)
+// the weight rows (w, and y of Axpy) are in the format of -storage (see
+// weight_size), everything else is real
+// * Dot - returns sum(a[c] * w[c])
+// * Axpy - w[c] += alpha * x[c]
+// * Accum - y[c] += w[c]
+// * UpdatePair - the two updates after a dot product in ONE pass over w:
+//   e[c] += g * w[c] (the OLD w) and w[c] += g * h[c]
+// * Load / Store - a row to / from real
+// scalar versions below, AVX2 (+FMA) / AVX-512 versions picked at runtime
+// by InitKernels depending on the cpu and the storage
+real (*Dot)(real * a, void * w, long long n);
+// DotReal / AxpyReal - Dot / Axpy of real vectors whatever the storage
+real (*DotReal)(real * a, void * w, long long n);
+void (*AxpyReal)(void * w, real alpha, real * x, long long n);
+void (*Axpy)(void * w, real alpha, real * x, long long n);
+void (*Accum)(real * y, void * w, long long n);
+void (*UpdatePair)(real * e, void * w, real * h, real g, long long n);
+void (*Load)(real * y, void * w, long long n);
+void (*Store)(void * w, real * x, long long n);
+// Tile - 2 x 4 dot products of padded rows (tile.h), for -batch-negative and
+// the k-means of -classes
+void (*Tile)(float * m, float * q, long long stride, float * s);
+
+real DotScalar(real * a, void * w, long long n) {
+	real * b = (real *)w;
+	long long c;
+	real f = 0;
+	for (c = 0; c < n; c++) f += a[c] * b[c];
+	return f;
+}
+
+void AxpyScalar(void * w, real alpha, real * x, long long n) {
+	real * y = (real *)w;
+	long long c;
+	for (c = 0; c < n; c++) y[c] += alpha * x[c];
+}
+
+void UpdatePairScalar(real * e, void * wv, real * h, real g, long long n) {
+	real * w = (real *)wv;
+	long long c;
+	real t;
+	for (c = 0; c < n; c++) {
+		t = w[c];
+		e[c] += g * t;
+		w[c] = t + g * h[c];
+	}
+}
+
+// the same for float storage whatever the cpu
+void AccumFloat(real * y, void * w, long long n) {
+	Axpy(y, 1, (real *)w, n);
+}
+
+void LoadFloat(real * y, void * w, long long n) {
+	memcpy(y, w, n * sizeof(real));
+}
+
+void StoreFloat(void * w, real * x, long long n) {
+	memcpy(w, x, n * sizeof(real));
+}
+
+// HALF STORAGE (-storage 1 bf16, 2 fp16) - the rows are 16 bit, converted
+// to real on load and rounded on store (see RoundBF16), the arithmetic is real
+static inline real BF16ToReal(unsigned short h) {
+	unsigned int u = (unsigned int)h << 16;
+	real f;
+	memcpy(&f, &u, sizeof(f));
+	return f;
+}
+
+static inline unsigned short RealToBF16(real f) {
+	unsigned int u;
+	memcpy(&u, &f, sizeof(u));
+	return (u + 0x7FFF + ((u >> 16) & 1)) >> 16;
+}
+
+// updates smaller than half a bf16 step (1 / 256 of the weight, 1 / 2048 for fp16)
+// would always round back to the old value, so the trained rows round them
+// STOCHASTICALLY - up with the probability of the dropped fraction, the expectation
+// is the exact sum (RoundBF16, RoundFP16).
+// round_state - xorshift32 states of this thread, one per lane of the vectors
+static __thread unsigned int round_state[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+
+void SeedRounding(unsigned long long s) {
+	int a;
+	for (a = 0; a < 8; a++) {
+		s = s * 6364136223846793005ULL + 1442695040888963407ULL;
+		round_state[a] = (unsigned int)(s >> 32) | 1;
+	}
+}
+
+static inline unsigned short RoundBF16(real f) {
+	unsigned int u, r = round_state[0];
+	r ^= r << 13;
+	r ^= r >> 17;
+	r ^= r << 5;
+	round_state[0] = r;
+	memcpy(&u, &f, sizeof(u));
+	return (u + (r & 0xFFFF)) >> 16;
+}
+
+static inline real FP16ToReal(unsigned short h) {
+	unsigned int sign = (unsigned int)(h & 0x8000) << 16, e = (h >> 10) & 0x1F, m = h & 0x3FF, u;
+	real f;
+	if (e == 0) {
+		// zero or subnormal - m * 2^-24
+		f = m * (1.0f / 16777216);
+		return sign ? -f : f;
+	}
+	if (e == 31) u = sign | 0x7F800000 | (m << 13);
+	else u = sign | ((e + 112) << 23) | (m << 13);
+	memcpy(&f, &u, sizeof(f));
+	return f;
+}
+
+static inline unsigned short RealToFP16(real f) {
+	unsigned int u, sign, e, m, r;
+	memcpy(&u, &f, sizeof(u));
+	sign = (u >> 16) & 0x8000;
+	u &= 0x7FFFFFFF;
+	if (u >= 0x47800000) return sign | ((u > 0x7F800000) ? 0x7E00 : 0x7C00); // inf, nan, overflow
+	if (u < 0x38800000) {
+		// subnormal half (or 0) - the mantissa with the implicit 1, shifted down
+		e = u >> 23;
+		if (e < 102) return sign;
+		m = (u & 0x7FFFFF) | 0x800000;
+		r = m >> (126 - e);
+		// round to nearest even on the bits shifted out
+		m &= (1u << (126 - e)) - 1;
+		if ((m > (1u << (125 - e))) || ((m == (1u << (125 - e))) && (r & 1))) r++;
+		return sign | r;
+	}
+	// rebias the exponent, round the 13 dropped bits to nearest even
+	u = u - 0x38000000 + 0xFFF + ((u >> 13) & 1);
+	return sign | (u >> 13);
+}
+
+// the stochastic rounding to fp16 - a random fraction of a step is added to |f|, then
+// it is truncated (out of range saturates at the largest half, like the truncation of F16C)
+static inline unsigned short RoundFP16(real f) {
+	unsigned int u, sign, r = round_state[0];
+	real a;
+	r ^= r << 13;
+	r ^= r >> 17;
+	r ^= r << 5;
+	round_state[0] = r;
+	memcpy(&u, &f, sizeof(u));
+	sign = (u >> 16) & 0x8000;
+	u &= 0x7FFFFFFF;
+	if (u >= 0x7F800000) return RealToFP16(f); // inf, nan
+	if (u < 0x38800000) {
+		// subnormal half (or 0) - the steps are 2^-24 whatever the exponent of f
+		memcpy(&a, &u, sizeof(a));
+		return sign | (unsigned int)(a * 16777216 + (r & 0xFFFF) * (1.0f / 65536));
+	}
+	// the 13 dropped bits, a carry moves into the exponent as it should
+	u += r & 0x1FFF;
+	if (u >= 0x47800000) return sign | 0x7BFF;
+	return sign | ((u - 0x38000000) >> 13);
+}
+
+// UPDATE - the rounding of the trained rows (Axpy, UpdatePair), FROM_REAL - of Store
+#define HALF_KERNELS_SCALAR(NAME, TO_REAL, FROM_REAL, UPDATE) \
+real Dot##NAME(real * a, void * w, long long n) { \
+	unsigned short * b = (unsigned short *)w; \
+	long long c; \
+	real f = 0; \
+	for (c = 0; c < n; c++) f += a[c] * TO_REAL(b[c]); \
+	return f; \
+} \
+void Axpy##NAME(void * w, real alpha, real * x, long long n) { \
+	unsigned short * y = (unsigned short *)w; \
+	long long c; \
+	for (c = 0; c < n; c++) y[c] = UPDATE(TO_REAL(y[c]) + alpha * x[c]); \
+} \
+void Accum##NAME(real * y, void * w, long long n) { \
+	unsigned short * x = (unsigned short *)w; \
+	long long c; \
+	for (c = 0; c < n; c++) y[c] += TO_REAL(x[c]); \
+} \
+void UpdatePair##NAME(real * e, void * wv, real * h, real g, long long n) { \
+	unsigned short * w = (unsigned short *)wv; \
+	long long c; \
+	real t; \
+	for (c = 0; c < n; c++) { \
+		t = TO_REAL(w[c]); \
+		e[c] += g * t; \
+		w[c] = UPDATE(t + g * h[c]); \
+	} \
+} \
+void Load##NAME(real * y, void * w, long long n) { \
+	unsigned short * x = (unsigned short *)w; \
+	long long c; \
+	for (c = 0; c < n; c++) y[c] = TO_REAL(x[c]); \
+} \
+void Store##NAME(void * w, real * x, long long n) { \
+	unsigned short * y = (unsigned short *)w; \
+	long long c; \
+	for (c = 0; c < n; c++) y[c] = FROM_REAL(x[c]); \
+}
+
+HALF_KERNELS_SCALAR(BF16Scalar, BF16ToReal, RealToBF16, RoundBF16)
+HALF_KERNELS_SCALAR(FP16Scalar, FP16ToReal, RealToFP16, RoundFP16)
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2,fma")))
+real DotAVX2(real * a, void * w, long long n) {
+	real * b = (real *)w;
+	__m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+	__m128 s;
+	long long c = 0;
+	real f;
+	// two accumulators to hide the latency of fma
+	for (; c + 16 <= n; c += 16) {
+		s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + c), _mm256_loadu_ps(b + c), s0);
+		s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + c + 8), _mm256_loadu_ps(b + c + 8), s1);
+	}
+	if (c + 8 <= n) {
+		s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + c), _mm256_loadu_ps(b + c), s0);
+		c += 8;
+	}
+	s0 = _mm256_add_ps(s0, s1);
+	s = _mm_add_ps(_mm256_castps256_ps128(s0), _mm256_extractf128_ps(s0, 1));
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+	f = _mm_cvtss_f32(s);
+	for (; c < n; c++) f += a[c] * b[c];
+	return f;
+}
+
+__attribute__((target("avx2,fma")))
+void AxpyAVX2(void * w, real alpha, real * x, long long n) {
+	real * y = (real *)w;
+	__m256 va = _mm256_set1_ps(alpha);
+	long long c = 0;
+	for (; c + 8 <= n; c += 8)
+		_mm256_storeu_ps(y + c, _mm256_fmadd_ps(va, _mm256_loadu_ps(x + c), _mm256_loadu_ps(y + c)));
+	for (; c < n; c++) y[c] += alpha * x[c];
+}
+
+__attribute__((target("avx2,fma")))
+void UpdatePairAVX2(real * e, void * wv, real * h, real g, long long n) {
+	real * w = (real *)wv;
+	__m256 vg = _mm256_set1_ps(g), vw;
+	long long c = 0;
+	real t;
+	for (; c + 8 <= n; c += 8) {
+		vw = _mm256_loadu_ps(w + c);
+		_mm256_storeu_ps(e + c, _mm256_fmadd_ps(vg, vw, _mm256_loadu_ps(e + c)));
+		_mm256_storeu_ps(w + c, _mm256_fmadd_ps(vg, _mm256_loadu_ps(h + c), vw));
+	}
+	for (; c < n; c++) {
+		t = w[c];
+		e[c] += g * t;
+		w[c] = t + g * h[c];
+	}
+}
+
+// 8 halves to / from a vector of 8 reals
+__attribute__((target("avx2")))
+static inline __m256 LoadBF16x8(unsigned short * p) {
+	return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i *)p)), 16));
+}
+
+__attribute__((target("avx2")))
+static inline void StoreBF16x8(unsigned short * p, __m256 v) {
+	__m256i u = _mm256_castps_si256(v);
+	u = _mm256_add_epi32(u, _mm256_add_epi32(_mm256_set1_epi32(0x7FFF), _mm256_and_si256(_mm256_srli_epi32(u, 16), _mm256_set1_epi32(1))));
+	u = _mm256_srli_epi32(u, 16);
+	// packus works per 128 bit lane, the permute puts the two halves together
+	u = _mm256_permute4x64_epi64(_mm256_packus_epi32(u, u), 0xD8);
+	_mm_storeu_si128((__m128i *)p, _mm256_castsi256_si128(u));
+}
+
+// 16 random bits for each of 8 lanes - a draw of the xorshift32 streams in rs
+// (round_state, lane a from round_state[a], kept in a register over a whole row)
+// is used twice, the low then the high half, the serial chain of draws is what
+// limits the kernels
+__attribute__((target("avx2")))
+static inline __m256i NextRandom8(__m256i * rs, long long c) {
+	__m256i r = *rs;
+	if (c & 8) return _mm256_srli_epi32(r, 16);
+	r = _mm256_xor_si256(r, _mm256_slli_epi32(r, 13));
+	r = _mm256_xor_si256(r, _mm256_srli_epi32(r, 17));
+	r = _mm256_xor_si256(r, _mm256_slli_epi32(r, 5));
+	*rs = r;
+	return r;
+}
+
+// the stochastic rounding of RoundBF16
+__attribute__((target("avx2")))
+static inline void RoundBF16x8(unsigned short * p, __m256 v, __m256i r) {
+	__m256i u;
+	u = _mm256_add_epi32(_mm256_castps_si256(v), _mm256_and_si256(r, _mm256_set1_epi32(0xFFFF)));
+	u = _mm256_srli_epi32(u, 16);
+	u = _mm256_permute4x64_epi64(_mm256_packus_epi32(u, u), 0xD8);
+	_mm_storeu_si128((__m128i *)p, _mm256_castsi256_si128(u));
+}
+
+__attribute__((target("avx2,f16c")))
+static inline __m256 LoadFP16x8(unsigned short * p) {
+	return _mm256_cvtph_ps(_mm_loadu_si128((__m128i *)p));
+}
+
+__attribute__((target("avx2,f16c")))
+static inline void StoreFP16x8(unsigned short * p, __m256 v) {
+	_mm_storeu_si128((__m128i *)p, _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+}
+
+// the stochastic rounding of RoundFP16 with F16C - |v| plus a random fraction of
+// the step of a half there (2^-10 of its power of 2, at least 2^-24), truncated
+__attribute__((target("avx2,fma,f16c")))
+static inline void RoundFP16x8(unsigned short * p, __m256 v, __m256i r) {
+	__m256 sign = _mm256_set1_ps(-0.0f), a = _mm256_andnot_ps(sign, v);
+	// the step * 2^-16, as the bits of a float
+	__m256i step = _mm256_max_epi32(_mm256_sub_epi32(_mm256_and_si256(_mm256_castps_si256(v), _mm256_set1_epi32(0x7F800000)),
+		_mm256_set1_epi32(26 << 23)), _mm256_set1_epi32(0x2B800000));
+	a = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_and_si256(r, _mm256_set1_epi32(0xFFFF))), _mm256_castsi256_ps(step), a);
+	_mm_storeu_si128((__m128i *)p, _mm256_cvtps_ph(_mm256_or_ps(a, _mm256_and_ps(sign, v)), _MM_FROUND_TO_ZERO));
+}
+
+// (the rounded updates do the tail through a zero padded block of 8 as well)
+#define HALF_KERNELS_AVX2(NAME, TARGET, LOAD8, STORE8, UPDATE8, TO_REAL, FROM_REAL) \
+__attribute__((target(TARGET))) \
+real Dot##NAME(real * a, void * w, long long n) { \
+	unsigned short * b = (unsigned short *)w; \
+	__m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps(); \
+	__m128 s; \
+	long long c = 0; \
+	real f; \
+	for (; c + 16 <= n; c += 16) { \
+		s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + c), LOAD8(b + c), s0); \
+		s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + c + 8), LOAD8(b + c + 8), s1); \
+	} \
+	if (c + 8 <= n) { \
+		s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + c), LOAD8(b + c), s0); \
+		c += 8; \
+	} \
+	s0 = _mm256_add_ps(s0, s1); \
+	s = _mm_add_ps(_mm256_castps256_ps128(s0), _mm256_extractf128_ps(s0, 1)); \
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s)); \
+	s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1)); \
+	f = _mm_cvtss_f32(s); \
+	for (; c < n; c++) f += a[c] * TO_REAL(b[c]); \
+	return f; \
+} \
+__attribute__((target(TARGET))) \
+void Axpy##NAME(void * w, real alpha, real * x, long long n) { \
+	unsigned short * y = (unsigned short *)w; \
+	__m256 va = _mm256_set1_ps(alpha); \
+	__m256i rs = _mm256_loadu_si256((__m256i *)round_state); \
+	long long c = 0; \
+	unsigned short ty[8] = {0}; \
+	real tx[8] = {0}; \
+	for (; c + 8 <= n; c += 8) UPDATE8(y + c, _mm256_fmadd_ps(va, _mm256_loadu_ps(x + c), LOAD8(y + c)), NextRandom8(&rs, c)); \
+	if (c < n) { \
+		memcpy(ty, y + c, (n - c) * sizeof(unsigned short)); \
+		memcpy(tx, x + c, (n - c) * sizeof(real)); \
+		UPDATE8(ty, _mm256_fmadd_ps(va, _mm256_loadu_ps(tx), LOAD8(ty)), NextRandom8(&rs, c)); \
+		memcpy(y + c, ty, (n - c) * sizeof(unsigned short)); \
+	} \
+	_mm256_storeu_si256((__m256i *)round_state, rs); \
+} \
+__attribute__((target(TARGET))) \
+void Accum##NAME(real * y, void * w, long long n) { \
+	unsigned short * x = (unsigned short *)w; \
+	long long c = 0; \
+	for (; c + 8 <= n; c += 8) _mm256_storeu_ps(y + c, _mm256_add_ps(_mm256_loadu_ps(y + c), LOAD8(x + c))); \
+	for (; c < n; c++) y[c] += TO_REAL(x[c]); \
+} \
+__attribute__((target(TARGET))) \
+void UpdatePair##NAME(real * e, void * wv, real * h, real g, long long n) { \
+	unsigned short * w = (unsigned short *)wv; \
+	__m256 vg = _mm256_set1_ps(g), vw; \
+	__m256i rs = _mm256_loadu_si256((__m256i *)round_state); \
+	long long c = 0; \
+	unsigned short tw[8] = {0}; \
+	real te[8] = {0}, th[8] = {0}; \
+	for (; c + 8 <= n; c += 8) { \
+		vw = LOAD8(w + c); \
+		_mm256_storeu_ps(e + c, _mm256_fmadd_ps(vg, vw, _mm256_loadu_ps(e + c))); \
+		UPDATE8(w + c, _mm256_fmadd_ps(vg, _mm256_loadu_ps(h + c), vw), NextRandom8(&rs, c)); \
+	} \
+	if (c < n) { \
+		memcpy(tw, w + c, (n - c) * sizeof(unsigned short)); \
+		memcpy(te, e + c, (n - c) * sizeof(real)); \
+		memcpy(th, h + c, (n - c) * sizeof(real)); \
+		vw = LOAD8(tw); \
+		_mm256_storeu_ps(te, _mm256_fmadd_ps(vg, vw, _mm256_loadu_ps(te))); \
+		UPDATE8(tw, _mm256_fmadd_ps(vg, _mm256_loadu_ps(th), vw), NextRandom8(&rs, c)); \
+		memcpy(w + c, tw, (n - c) * sizeof(unsigned short)); \
+		memcpy(e + c, te, (n - c) * sizeof(real)); \
+	} \
+	_mm256_storeu_si256((__m256i *)round_state, rs); \
+} \
+__attribute__((target(TARGET))) \
+void Load##NAME(real * y, void * w, long long n) { \
+	unsigned short * x = (unsigned short *)w; \
+	long long c = 0; \
+	for (; c + 8 <= n; c += 8) _mm256_storeu_ps(y + c, LOAD8(x + c)); \
+	for (; c < n; c++) y[c] = TO_REAL(x[c]); \
+} \
+__attribute__((target(TARGET))) \
+void Store##NAME(void * w, real * x, long long n) { \
+	unsigned short * y = (unsigned short *)w; \
+	long long c = 0; \
+	for (; c + 8 <= n; c += 8) STORE8(y + c, _mm256_loadu_ps(x + c)); \
+	for (; c < n; c++) y[c] = FROM_REAL(x[c]); \
+}
+
+HALF_KERNELS_AVX2(BF16AVX2, "avx2,fma", LoadBF16x8, StoreBF16x8, RoundBF16x8, BF16ToReal, RealToBF16)
+HALF_KERNELS_AVX2(FP16AVX2, "avx2,fma,f16c", LoadFP16x8, StoreFP16x8, RoundFP16x8, FP16ToReal, RealToFP16)
+
+// AVX-512 - the tail (e.g. 300 = 18 * 16 + 12) is done with masked loads/stores
+__attribute__((target("avx512f")))
+real DotAVX512(real * a, void * w, long long n) {
+	real * b = (real *)w;
+	__m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+	__mmask16 m;
+	long long c = 0;
+	for (; c + 32 <= n; c += 32) {
+		s0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + c), _mm512_loadu_ps(b + c), s0);
+		s1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + c + 16), _mm512_loadu_ps(b + c + 16), s1);
+	}
+	for (; c + 16 <= n; c += 16)
+		s0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + c), _mm512_loadu_ps(b + c), s0);
+	if (c < n) {
+		m = (__mmask16)((1 << (n - c)) - 1);
+		s1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, a + c), _mm512_maskz_loadu_ps(m, b + c), s1);
+	}
+	return _mm512_reduce_add_ps(_mm512_add_ps(s0, s1));
+}
+
+__attribute__((target("avx512f")))
+void AxpyAVX512(void * w, real alpha, real * x, long long n) {
+	real * y = (real *)w;
+	__m512 va = _mm512_set1_ps(alpha);
+	__mmask16 m;
+	long long c = 0;
+	for (; c + 16 <= n; c += 16)
+		_mm512_storeu_ps(y + c, _mm512_fmadd_ps(va, _mm512_loadu_ps(x + c), _mm512_loadu_ps(y + c)));
+	if (c < n) {
+		m = (__mmask16)((1 << (n - c)) - 1);
+		_mm512_mask_storeu_ps(y + c, m, _mm512_fmadd_ps(va, _mm512_maskz_loadu_ps(m, x + c), _mm512_maskz_loadu_ps(m, y + c)));
+	}
+}
+
+__attribute__((target("avx512f")))
+void UpdatePairAVX512(real * e, void * wv, real * h, real g, long long n) {
+	real * w = (real *)wv;
+	__m512 vg = _mm512_set1_ps(g), vw;
+	__mmask16 m;
+	long long c = 0;
+	for (; c + 16 <= n; c += 16) {
+		vw = _mm512_loadu_ps(w + c);
+		_mm512_storeu_ps(e + c, _mm512_fmadd_ps(vg, vw, _mm512_loadu_ps(e + c)));
+		_mm512_storeu_ps(w + c, _mm512_fmadd_ps(vg, _mm512_loadu_ps(h + c), vw));
+	}
+	if (c < n) {
+		m = (__mmask16)((1 << (n - c)) - 1);
+		vw = _mm512_maskz_loadu_ps(m, w + c);
+		_mm512_mask_storeu_ps(e + c, m, _mm512_fmadd_ps(vg, vw, _mm512_maskz_loadu_ps(m, e + c)));
+		_mm512_mask_storeu_ps(w + c, m, _mm512_fmadd_ps(vg, _mm512_maskz_loadu_ps(m, h + c), vw));
+	}
+}
+#endif
+
+void InitKernels() {
+	// picks the widest kernels the cpu supports, for the storage
+	// (the half ones go up to AVX2, the conversions dominate there anyway)
+	char * name = (char *)"scalar";
+	Dot = DotScalar;
+	Axpy = AxpyScalar;
+	UpdatePair = UpdatePairScalar;
+	Accum = AccumFloat;
+	Load = LoadFloat;
+	Store = StoreFloat;
+	if (storage == 1) {
+		Dot = DotBF16Scalar;
+		Axpy = AxpyBF16Scalar;
+		Accum = AccumBF16Scalar;
+		UpdatePair = UpdatePairBF16Scalar;
+		Load = LoadBF16Scalar;
+		Store = StoreBF16Scalar;
+	} else if (storage == 2) {
+		Dot = DotFP16Scalar;
+		Axpy = AxpyFP16Scalar;
+		Accum = AccumFP16Scalar;
+		UpdatePair = UpdatePairFP16Scalar;
+		Load = LoadFP16Scalar;
+		Store = StoreFP16Scalar;
+	}
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (storage == 1) {
+		if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+			Dot = DotBF16AVX2;
+			Axpy = AxpyBF16AVX2;
+			Accum = AccumBF16AVX2;
+			UpdatePair = UpdatePairBF16AVX2;
+			Load = LoadBF16AVX2;
+			Store = StoreBF16AVX2;
+			name = (char *)"AVX2";
+		}
+	} else if (storage == 2) {
+		if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c")) {
+			Dot = DotFP16AVX2;
+			Axpy = AxpyFP16AVX2;
+			Accum = AccumFP16AVX2;
+			UpdatePair = UpdatePairFP16AVX2;
+			Load = LoadFP16AVX2;
+			Store = StoreFP16AVX2;
+			name = (char *)"AVX2";
+		}
+	} else if (__builtin_cpu_supports("avx512f")) {
+		Dot = DotAVX512;
+		Axpy = AxpyAVX512;
+		UpdatePair = UpdatePairAVX512;
+		name = (char *)"AVX-512";
+	} else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+		Dot = DotAVX2;
+		Axpy = AxpyAVX2;
+		UpdatePair = UpdatePairAVX2;
+		name = (char *)"AVX2";
+	}
+#endif
+	DotReal = DotScalar;
+	AxpyReal = AxpyScalar;
+#if defined(__x86_64__) || defined(__i386__)
+	if (__builtin_cpu_supports("avx512f")) {
+		DotReal = DotAVX512;
+		AxpyReal = AxpyAVX512;
+	} else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+		DotReal = DotAVX2;
+		AxpyReal = AxpyAVX2;
+	}
+#endif
+	InitTile(&Tile);
+	if (debug_mode > 1) printf("Using %s kernels%s\n", name, (storage == 1) ? " (bf16 storage)" : (storage == 2) ? " (fp16 storage)" : "");
 }
 
 // IT SEEMS that hs and negative can be used TOGETHER
+int ReadCpuList(char * name, cpu_set_t * set) {
+	// a sysfs cpu list like "0-3,8-11" into set, 0 if the file cannot be read
+	FILE * f = fopen(name, "rb");
+	int a, b, c;
+	CPU_ZERO(set);
+	if (f == NULL) return 0;
+	while (fscanf(f, "%d", &a) == 1) {
+		b = a;
+		c = fgetc(f);
+		if (c == '-') {
+			if (fscanf(f, "%d", &b) != 1) break;
+			c = fgetc(f);
+		}
+		for (; (a <= b) && (a < CPU_SETSIZE); a++) CPU_SET(a, set);
+		if (c != ',') break;
+	}
+	fclose(f);
+	return 1;
+}
+
+// a cpu of InitCpus: rank - 0 for the first hyperthread of a core, 1 for its sibling..,
+// slot - its place among the cpus of the same node and rank
+struct cpu_slot {
+	int cpu, node, rank, slot;
+};
+
+int CpuSlotCompare(const void * a, const void * b) {
+	const struct cpu_slot * x = (const struct cpu_slot *)a, * y = (const struct cpu_slot *)b;
+	if (x->rank != y->rank) return x->rank - y->rank;
+	if (x->slot != y->slot) return x->slot - y->slot;
+	return x->node - y->node;
+}
+
+void InitCpus() {
+	// the cpus this process may run on, thread t gets pinned to cpu_list[t % cpu_count]
+	// the list goes round-robin over the numa nodes, and over the physical cores
+	// before any hyperthread sibling, so that a few threads still spread over all the
+	// nodes (and the weights with them, see InitNetThread)
+	cpu_set_t set, node_set, siblings;
+	struct cpu_slot * cpus;
+	int c, d, node;
+	char name[MAX_STRING];
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) != 0) return;
+	cpu_list = (int *)malloc(CPU_SETSIZE * sizeof(int));
+	cpus = (struct cpu_slot *)malloc(CPU_SETSIZE * sizeof(struct cpu_slot));
+	for (c = 0; c < CPU_SETSIZE; c++) if (CPU_ISSET(c, &set)) {
+		cpus[cpu_count].cpu = c;
+		cpus[cpu_count].node = 0;
+		cpus[cpu_count].rank = 0;
+		// the siblings of c before it
+		sprintf(name, "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", c);
+		if (ReadCpuList(name, &siblings)) for (d = 0; d < c; d++) if (CPU_ISSET(d, &siblings)) cpus[cpu_count].rank++;
+		cpu_count++;
+	}
+	for (node = 0; node < CPU_SETSIZE; node++) {
+		sprintf(name, "/sys/devices/system/node/node%d/cpulist", node);
+		if (access(name, F_OK) != 0) continue;
+		if (!ReadCpuList(name, &node_set)) continue;
+		for (c = 0; c < cpu_count; c++) if (CPU_ISSET(cpus[c].cpu, &node_set)) cpus[c].node = node;
+	}
+	// slot - in cpu number order within (node, rank)
+	for (c = 0; c < cpu_count; c++) {
+		cpus[c].slot = 0;
+		for (d = 0; d < c; d++) if ((cpus[d].node == cpus[c].node) && (cpus[d].rank == cpus[c].rank)) cpus[c].slot++;
+	}
+	qsort(cpus, cpu_count, sizeof(struct cpu_slot), CpuSlotCompare);
+	for (c = 0; c < cpu_count; c++) cpu_list[c] = cpus[c].cpu;
+	free(cpus);
+	if (debug_mode > 1) {
+		printf("Pinning threads to cpus");
+		for (c = 0; c < cpu_count && c < 16; c++) printf(" %d", cpu_list[c]);
+		printf("%s\n", (cpu_count > 16) ? " ..." : "");
+	}
+}
+
+void PinThread(long long id) {
+	cpu_set_t set;
+	if (!numa || cpu_count == 0) return;
+	CPU_ZERO(&set);
+	CPU_SET(cpu_list[id % cpu_count], &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+real * AllocWeights() {
+	// page aligned so that the pages of the matrix can be bound/first-touched one by one
+	real * m = NULL;
+	unsigned long mask = 0;
+	long long size = (long long)vocab_size * layer1_size * weight_size;
+	int node;
+	char name[MAX_STRING];
+	if (posix_memalign((void **)&m, numa ? 4096 : 128, size) != 0) m = NULL;
+	if (m == NULL) {printf("Memory allocation failed\n"); exit(1);}
+	if (numa == 2) {
+		for (node = 0; node < (int)sizeof(mask) * 8; node++) {
+			sprintf(name, "/sys/devices/system/node/node%d", node);
+			if (access(name, F_OK) == 0) mask |= 1UL << node;
+		}
+		// MPOL_INTERLEAVE, through the raw syscall to not depend on libnuma
+		if (syscall(SYS_mbind, m, size, 3, &mask, sizeof(mask) * 8, 0) != 0 && debug_mode > 0)
+			printf("WARNING: cannot interleave the weights over the numa nodes\n");
+	}
+	return m;
+}
+
+void *InitNetThread(void *id) {
+	// initializes this thread's rows of the weights, with numa the pages then live
+	// on the node of the cpu that the training thread of the same id is pinned to
+	long long a0 = vocab_size / num_threads * (long long)id;
+	long long a1 = ((long long)id == num_threads - 1) ? vocab_size : a0 + vocab_size / num_threads;
+	long long a, b;
+	size_t len = (a1 - a0) * layer1_size * weight_size;
+	unsigned long long r;
+	real * row = (real *)malloc(layer1_size * sizeof(real));
+	PinThread((long long)id);
+	// syn0 to uniform [-0.5, 0.5] / layer1_size, row by row
+	// every value is a hash (splitmix64) of seed and its position, so the model
+	// only depends on the seed and not on the number of threads, and the
+	// elements are independent so the inner loop vectorizes
+	for (a = a0; a < a1; a++) {
+		for (b = 0; b < layer1_size; b++) {
+			r = seed + (a * layer1_size + b + 1) * 0x9E3779B97F4A7C15ULL;
+			r = (r ^ (r >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			r = (r ^ (r >> 27)) * 0x94D049BB133111EBULL;
+			r ^= r >> 31;
+			row[b] = ((r >> 40) / (real)(1 << 24) - 0.5) / layer1_size;
+		}
+		Store(WEIGHT(syn0, a * layer1_size), row, layer1_size);
+	}
+	// 0 is all zero bits in every storage
+	if (hs) memset(WEIGHT(syn1, a0 * layer1_size), 0, len);
+	if (negative > 0) memset(WEIGHT(syn1neg, a0 * layer1_size), 0, len);
+	free(row);
+	pthread_exit(NULL);
+}
+
 void InitNet() {
 	// intialize the neural network structure
-	long long a, b;
+	long long a;
+	pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
 	// SOME CONVENTIONS : layer1_size will the the dimension of feature space
 	// syn0 and syn1/syn1neg are of size vocab_size * layer1_size
-	// allocate the memory to syn0, a stores return code
 	// syn0 is actually of (real *)
-	a = posix_memlign((void **)&syn0, 128, (long long)vocab_size * layer1_size * sizeof(real));
-	if (syn0 == NULL) {
-		printf("Memory allocation failed\n"); exit(1);
-	}
+	syn0 = AllocWeights();
 	// Hierarchical Softmax 
-	if (hs) {
-		// allocate memory to syn1, a stores return code
-		a = posix_memlign((void **)&syn1, 128, (long long)vocab_size * layer1_size * sizeof(real));
-		if (syn1 == NULL) {printf("Memory allocation failed\n"); exit(1);}
-		for (b = 0; b < layer1_size; b++) for (a = 0; a < vocab_size; a++)
-			syn1[a * layer1_size + b] = 0;
-	}
+	if (hs) syn1 = AllocWeights();
 	// Negative Sampling
-	if (negative > 0) {
-		a = posix_memlign((void **)&syn1neg, 128, (long long)vocab_size * layer1_size * sizeof(real));
-		if (syn1neg == NULL) {printf("Memory allocaiton failed\n"); exit(1);}
-		for (b = 0; b < layer1_size; b++) for (a = 0; a < vocab_size; a++)
-			syn1neg[a * layer1_size + b] = 0;
-	}
+	if (negative > 0) syn1neg = AllocWeights();
 	// Initialization of syn0 layer to [-0.5, 0.5] / layer1_size
-	// 0 mean, 0.0015 std, though it is a uniform distribution
-	for (b = 0; b < layer1_size; b++) for (a = 0; a < vocab_size; a++)
-		syn0[a * layer1_size + b] = (rand() / (real)RAND_MAX - 0.5) / layer1_size;
-	CreateBinaryTree();
+	// 0 mean, 0.0015 std, though it is a uniform distribution, syn1/syn1neg to 0
+	// first touch of all the pages happens here, spread over the threads
+	for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, InitNetThread, (void *)a);
+	for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+	free(pt);
+}
+
+double SecondsSince(struct timespec * t) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) + (now.tv_nsec - t->tv_nsec) / 1e9;
+}
+
+long long UpdateProgress(long long id, long long words) {
+	// Publishes the words trained so far by thread id (all epochs) and
+	// returns the total of all the threads - the only place where the
+	// threads look at each other's progress
+	long long a, sum = 0;
+	__atomic_store_n(&progress[id].words, words, __ATOMIC_RELAXED);
+	for (a = 0; a < num_threads; a++) sum += __atomic_load_n(&progress[a].words, __ATOMIC_RELAXED);
+	return sum;
+}
+
+static inline void SaveThreadState(long long id, struct thread_state * state) {
+	// only thread id writes its entry, the snapshot reads slot[current]
+	struct thread_checkpoint * c = &thread_checkpoints[id];
+	int next = 1 - c->current;
+	c->slot[next] = *state;
+	__atomic_store_n(&c->current, next, __ATOMIC_RELEASE);
+}
+
+int WriteAll(int fd, void * data, long long size) {
+	// write(2) until all of data is out, 0 on failure
+	char * p = (char *)data;
+	long long n;
+	while (size > 0) {
+		n = write(fd, p, (size > (1 << 30)) ? (1 << 30) : size);
+		if (n <= 0) return 0;
+		p += n;
+		size -= n;
+	}
+	return 1;
+}
+
+void WriteCheckpointFile() {
+	// runs in the forked child, which sees the weights as they were at the fork
+	// plain syscalls only - another thread may have held a stdio or malloc lock
+	struct checkpoint_header h;
+	struct thread_state * state;
+	char name[MAX_STRING + 8];
+	long long a, size = vocab_size * layer1_size * weight_size;
+	int ok, fd;
+	strcpy(name, checkpoint_file);
+	strcat(name, ".tmp");
+	fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) _exit(1);
+	memset(&h, 0, sizeof(h));
+	strcpy(h.magic, "W2VCKPT");
+	h.vocab_size = vocab_size;
+	h.vocab_checksum = VocabChecksum(vocab, vocab_size);
+	h.layer1_size = layer1_size;
+	h.hs = hs;
+	h.negative = negative;
+	h.num_threads = num_threads;
+	h.iter = iter;
+	h.storage = storage;
+	h.ids = (ids_data != NULL);
+	// (-ids-width also sets the width of -save-ids in a text run)
+	h.ids_width = (ids_data != NULL) ? ids_width : 0;
+	h.file_size = file_size;
+	for (a = 0; a < num_threads; a++) h.words += thread_checkpoints[a].slot[thread_checkpoints[a].current].words_done;
+	ok = WriteAll(fd, &h, sizeof(h));
+	for (a = 0; a < num_threads; a++) {
+		state = &thread_checkpoints[a].slot[__atomic_load_n(&thread_checkpoints[a].current, __ATOMIC_ACQUIRE)];
+		ok = ok && WriteAll(fd, state, sizeof(struct thread_state));
+	}
+	ok = ok && WriteAll(fd, syn0, size);
+	if (hs) ok = ok && WriteAll(fd, syn1, size);
+	if (negative > 0) ok = ok && WriteAll(fd, syn1neg, size);
+	ok = ok && (fsync(fd) == 0);
+	close(fd);
+	// the previous checkpoint stays until this one is complete
+	if (ok) ok = (rename(name, checkpoint_file) == 0);
+	_exit(ok ? 0 : 1);
+}
+
+void Checkpoint() {
+	// forks the snapshot - the training threads go on while the child writes
+	int status;
+	if (checkpoint_pid > 0) {
+		// the previous one has to be done first
+		waitpid(checkpoint_pid, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) printf("\nWARNING: cannot write the checkpoint %s\n", checkpoint_file);
+	}
+	fflush(stdout);
+	checkpoint_pid = fork();
+	if (checkpoint_pid == 0) WriteCheckpointFile();
+	if (checkpoint_pid < 0) {
+		printf("\nWARNING: cannot fork for the checkpoint\n");
+		checkpoint_pid = 0;
+	}
+}
+
+void WaitForTraining() {
+	// runs on the main thread while the training threads work, checkpointing
+	// every checkpoint_interval seconds until all of them are done
+	struct timespec last;
+	int status;
+	clock_gettime(CLOCK_MONOTONIC, &last);
+	while (__atomic_load_n(&threads_done, __ATOMIC_ACQUIRE) < num_threads) {
+		usleep(100000);
+		if (SecondsSince(&last) >= checkpoint_interval) {
+			Checkpoint();
+			clock_gettime(CLOCK_MONOTONIC, &last);
+		}
+	}
+	if (checkpoint_pid > 0) waitpid(checkpoint_pid, &status, 0);
+}
+
+void ReadCheckpoint() {
+	// -resume: the weights and the thread states, for the same vocab and settings
+	struct checkpoint_header h;
+	long long a, size = vocab_size * layer1_size * weight_size;
+	int ok;
+	FILE * fin = fopen(resume_file, "rb");
+	if (fin == NULL) {
+		printf("ERROR: checkpoint file not found!\n");
+		exit(1);
+	}
+	if ((fread(&h, sizeof(h), 1, fin) != 1) || strcmp(h.magic, "W2VCKPT")) {
+		printf("ERROR: %s is not a checkpoint file\n", resume_file);
+		exit(1);
+	}
+	if ((h.vocab_size != vocab_size) || (h.vocab_checksum != VocabChecksum(vocab, vocab_size))) {
+		printf("ERROR: %s was written with a different vocabulary\n", resume_file);
+		exit(1);
+	}
+	if ((h.layer1_size != layer1_size) || (h.hs != hs) || (h.negative != negative) || (h.num_threads != num_threads) || (h.iter != iter) || (h.storage != storage)) {
+		printf("ERROR: %s was written with -size %lld -hs %lld -negative %lld -threads %lld -iter %lld -storage %lld\n",
+			resume_file, h.layer1_size, h.hs, h.negative, h.num_threads, h.iter, h.storage);
+		exit(1);
+	}
+	// the positions are byte offsets, only meaningful in the same input
+	if ((h.ids != (ids_data != NULL)) || (h.ids_width != ((ids_data != NULL) ? ids_width : 0)) || (h.file_size != file_size)) {
+		printf("ERROR: %s was written training from %s (%lld bytes)\n", resume_file,
+			h.ids ? ((h.ids_width == 0) ? "varint ids" : (h.ids_width == 2) ? "2 byte ids" : "4 byte ids") : "text", h.file_size);
+		exit(1);
+	}
+	resume_states = (struct thread_state *)malloc(num_threads * sizeof(struct thread_state));
+	ok = (fread(resume_states, sizeof(struct thread_state), num_threads, fin) == num_threads);
+	ok = ok && (fread(syn0, 1, size, fin) == size);
+	if (hs) ok = ok && (fread(syn1, 1, size, fin) == size);
+	if (negative > 0) ok = ok && (fread(syn1neg, 1, size, fin) == size);
+	fclose(fin);
+	if (!ok) {
+		printf("ERROR: %s is truncated\n", resume_file);
+		exit(1);
+	}
+	// (a thread that has read the last word of the file is at file_size)
+	for (a = 0; a < num_threads; a++) if ((resume_states[a].pos < 0) || (resume_states[a].pos > file_size) ||
+		(resume_states[a].start_pos < 0) || (resume_states[a].start_pos > file_size)) {
+		printf("ERROR: %s has a thread position past the end of the input\n", resume_file);
+		exit(1);
+	}
+	for (a = 0; a < num_threads; a++) progress[a].words = resume_states[a].words_done;
+	resume_words = h.words;
+	if (debug_mode > 0) printf("Resuming after %lld words\n", h.words);
 }
 
 // learning: hs (hierarchical softmax) v.s. negative sampling
@@ -536,49 +1771,122 @@ void *TrainModelThread(void *id) {
 	long long a, b, d, word, last_word, sentence_length = 0, sentence_position = 0;
 	long long word_count = 0, last_word_count = 0, sen[MAX_SENTENCE_LENGTH + 1];
 	long long l1, l2, c, target, label;
+	long long i, j, nin, nout, stride = (layer1_size + 15) / 16 * 16;
 	// id is NOT a pointer to an address, it itself is an interger (long, long)
 	// see the caller function for details
 	unsigned long long next_random = (long long) id;
 	real f, g; // function and gradient
-	clock_t now;
+	real s[8];
+	// local_alpha - learning rate of this thread, follows the total progress
+	real local_alpha = starting_alpha;
+	// words_done - words trained by this thread over all the epochs so far,
+	// total - by all the threads (the old word_count_actual)
+	long long words_done = 0, total;
+	// pos - the read position of this thread in the mapped train_data
+	long long pos = file_size / (long long)num_threads * (long long)id, start_pos;
+	int eof = 0, local_iter = iter;
+	char buf[MAX_STRING];
 	// hidden output, neu1 is a vector, input syn0 is an matrix (collection of vectors)
-	real * neu1 = (real *)calloc(layer1_size, sizeof(real));
-	// ?? error of 
-	real * neu1e = (real *)calloc(layer1_size, sizeof(real));
-	// embarassingly parallel model - chunk the data file
+	// ?? neu1e - error of 
+	real * neu1, * neu1e, * in0;
+	// -batch-negative: copies of the syn0 rows of the context words (inm, up to 2 * window)
+	// and the syn1neg rows of the target + its negatives (outm), with their vocab indices,
+	// padded for Tile (stride, up to 4 more rows of outm), corr - the gradients of all
+	// the (context, output) pairs, din / dout - the summed updates of the inm / outm rows
+	real * inm = NULL, * outm = NULL, * corr = NULL, * din = NULL, * dout = NULL;
+	long long * inw = NULL, * outw = NULL;
+	// pinned before the buffers below and sen are first touched, so that
+	// with -numa their pages come from the node of this thread
+	PinThread((long long)id);
+	if (storage != 0) SeedRounding(seed * 1000003 + (long long)id);
+	neu1 = (real *)calloc(layer1_size, sizeof(real));
+	neu1e = (real *)calloc(layer1_size, sizeof(real));
+	if (batch_negative && (negative > 0)) {
+		if (posix_memalign((void **)&inm, 64, 2 * window * stride * sizeof(real))) inm = NULL;
+		if (posix_memalign((void **)&outm, 64, (negative + 4) * stride * sizeof(real))) outm = NULL;
+		if (posix_memalign((void **)&din, 64, 2 * window * stride * sizeof(real))) din = NULL;
+		if (posix_memalign((void **)&dout, 64, (negative + 1) * stride * sizeof(real))) dout = NULL;
+		corr = (real *)malloc(2 * window * (negative + 1) * sizeof(real));
+		inw = (long long *)malloc(2 * window * sizeof(long long));
+		outw = (long long *)malloc((negative + 1) * sizeof(long long));
+		if ((inm == NULL) || (outm == NULL) || (din == NULL) || (dout == NULL) || (corr == NULL) || (inw == NULL) || (outw == NULL)) {
+			printf("Memory allocation failed\n");
+			exit(1);
+		}
+		// the padding (columns past layer1_size, rows past nin / nout) is never loaded,
+		// zero or an older row it only adds scores that are not used
+		memset(inm, 0, 2 * window * stride * sizeof(real));
+		memset(outm, 0, (negative + 4) * stride * sizeof(real));
+	}
+	struct thread_state state;
+	// embarassingly parallel model - chunk the data file (see pos above)
 	// synchoronize on global structure of net 
-	FILE * fi = fopen(train_file, "rb");
-	fseek(fi, file_size / (long long)num_threads * (long long)id, SEEK_SET);
+	// (an ids stream is chunked on index boundaries)
+	if (ids_data != NULL) pos = IdsChunkStart(pos);
+	// every epoch starts over from here
+	start_pos = pos;
+	// or carry on from the checkpoint (the progress of all the threads is restored by TrainModel)
+	if (resume_states != NULL) {
+		state = resume_states[(long long)id];
+		pos = state.pos;
+		start_pos = state.start_pos;
+		word_count = state.word_count;
+		last_word_count = state.last_word_count;
+		words_done = state.words_done;
+		local_iter = state.local_iter;
+		next_random = state.next_random;
+		// the rounding stream carries on where it was (SeedRounding above started it over)
+		if (storage != 0) memcpy(round_state, state.round_state, sizeof(round_state));
+		total = UpdateProgress((long long)id, words_done);
+		local_alpha = starting_alpha * (1 - total / (real)(iter * train_words + 1));
+		if (local_alpha < starting_alpha * 0.0001) local_alpha = starting_alpha * 0.0001;
+	}
 	// RELATED VARIABLES: 
-	// word, last_word, word_count, last_word_count (word_count_actual local copy)
+	// word, last_word, word_count, last_word_count (published in words_done)
 	// sentence_length, sentence_position
-	// word_count_actual - global variable to share among different threads
-	while (1) {
+	// progress - per thread counters, the only thing shared among the threads
+	while (local_iter > 0) {
 		// use word_count to control learning rate (decreasing and converging)
 		// every time when another 10000 words have been counted
 		if (word_count - last_word_count > 10000) {
-			word_count_actual += word_count - last_word_count;
+			words_done += word_count - last_word_count;
 			last_word_count = word_count;
-			if (debug_mode > 1) {
-				now = clock();
-				printf("%cAlpah: %f Progress: %.2f%% Words/thread/sec: %.2fk ", 13, alpha, 
-					word_count_actual / (real)(train_words + 1) * 100,
-					word_count_actual / ((real)(now - start + 1) / (real)CLOCKS_PER_SEC * 1000));
+			total = UpdateProgress((long long)id, words_done);
+			// one thread is enough to show the progress
+			if ((debug_mode > 1) && ((long long)id == 0)) {
+				printf("%cAlpah: %f Progress: %.2f%% Words/thread/sec: %.2fk ", 13, local_alpha,
+					total / (real)(iter * train_words + 1) * 100,
+					(total - resume_words) / ((SecondsSince(&start) + 1e-6) * num_threads * 1000));
 				fflush(stdout);
 			}
-			alpha = strarting_alpha * (1 - word_count_actual / (real)(train_words + 1));
-			if (alpha < starting_alpha * 0.0001) alpha = starting_alpha * 0.0001;
+			// alpha decays linearly over ALL the epochs
+			local_alpha = starting_alpha * (1 - total / (real)(iter * train_words + 1));
+			if (local_alpha < starting_alpha * 0.0001) local_alpha = starting_alpha * 0.0001;
 		}
 		// if sen is empty, create the sentence by reading words from file
 		// and add their vocab index to sen, initialize sentence_position = 0
 		// Discarding some infrequent words based on subsampling  
 		// ONLY read when sen is EMPTY AGAIN and REFILL IT
 		if (sentence_length == 0) {
+			if (checkpoint_file[0] != 0) {
+				state.pos = pos;
+				state.start_pos = start_pos;
+				state.word_count = word_count;
+				state.last_word_count = last_word_count;
+				state.words_done = words_done;
+				state.local_iter = local_iter;
+				state.next_random = next_random;
+				memcpy(state.round_state, round_state, sizeof(round_state));
+				SaveThreadState((long long)id, &state);
+			}
 			while(1) {
 				// read a word from file chunk and find the its index in vocab
-				word = ReadWordIndex(fi);
+				word = (ids_data != NULL) ? ReadIdIndex(&pos) : ReadWordIndex(&pos, buf);
 				// end of word stream
-				if (feof(fi)) break;
+				if (word == -2) {
+					eof = 1;
+					break;
+				}
 				// word not found in vocab
 				if (word == -1) continue;
 				word_count++;
@@ -587,9 +1895,8 @@ void *TrainModelThread(void *id) {
 				// the subsampling randomly discards infrequent
 				// words while keeping the ranking same
 				if (sample > 0) {
-					real ran = (sqrt(vocab[word].cn / (sample * train_words)) + 1) * (sample * train_words) / vocab[word].cn;
 					next_random = next_random * (unsigned long long)25214903917 + 11;
-					if (ran < (next_random & 0xFFFF) / (real)65536) continue;
+					if ((next_random & 0xFFFF) > keep_threshold[word]) continue;
 				}
 				// add word (index) to sen
 				sen[sentence_length] = word;
@@ -600,15 +1907,26 @@ void *TrainModelThread(void *id) {
 			sentence_position = 0;
 		}
 		// end of file or exceeds to the next chunk of data - stop
-		if (feof(fi)) break;
-		if (word_count > train_words / num_threads) break;
+		// end of this thread's chunk - next epoch from the start of the chunk
+		if (eof || (word_count > train_words / num_threads)) {
+			words_done += word_count - last_word_count;
+			UpdateProgress((long long)id, words_done);
+			local_iter--;
+			if (local_iter == 0) break;
+			word_count = 0;
+			last_word_count = 0;
+			sentence_length = 0;
+			pos = start_pos;
+			eof = 0;
+			continue;
+		}
 		// for word(index) in sentence
 		word = sen[sentence_position];
 		// no word at all - should NOT get into sen in the first place
 		if (word == -1) continue;
 		// initialize neu1 and its error
-		for (c = 0; c < layer1_size; c++) neu1[c] = 0;
-		for (c = 0; c < layer1_size; c++) neu1e[c] = 0;
+		memset(neu1, 0, layer1_size * sizeof(real));
+		memset(neu1e, 0, layer1_size * sizeof(real));
 		// comments on random seed - 
 		// http://ozark.hendrix.edu/~burch/logisim/docs/2.3.0/libs/mem/random.html
 		next_random = next_random * (unsigned long long)25214903917 + 11;
@@ -635,37 +1953,164 @@ void *TrainModelThread(void *id) {
 				// accumulate the feats of lastword in syn0 to neu1
 				// last word be iterating from the sliding window [-(window-b), +(window+b)] 
 				// around current word (sen[sentence_position] or word)
-				for (c = 0; c < layer1_size; c++) 
-					neu1[c] += syn0[c + last_word * layer1_size];
+				Accum(neu1, WEIGHT(syn0, last_word * layer1_size), layer1_size);
 			}
 			// HIERARCHICAL SOFTMAX
 			// PRECONDITION: word = sen[sentence_position]
-			if (hs) for (d = 0; d < vocab[word].codelen; d++) {
+			if (hs) for (d = 0; d < tree_offset[word + 1] - tree_offset[word]; d++) {
 				f = 0; // OBJECTIVE function
 				// the feature start in syn0 for parent node of vocab[word]
-				l2 = vocab[word].point[d] * layer1_size;
+				l2 = tree_points[tree_offset[word] + d] * layer1_size;
 				// propagate hidden -> output
-				for (c = 0; c < layer1_size; c++) f += neu1[c] * syn1[c + l2];
+				f = Dot(neu1, WEIGHT(syn1, l2), layer1_size);
 				if (f <= -MAX_EXP) continue;
 				else if (f >= MAX_EXP) continue;
 				else f = expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))];
 				// g is the gradient multiplied by the learning rate
-				g = (1 - vocab[word].code[d] -f) * alpha;
-				// propogate errors output -> hidden
-				for (c = 0; c < layer1_size; c++) neu1e[c] += g * syn1[c + l2];
-				// learning weights hidden -> output
-				for (c = 0; c < layer1_size; c++) syn1[c + l2] += g * neu1[c];
+				g = (1 - (real)((tree_codes[word] >> d) & 1) - f) * local_alpha;
+				// propogate errors output -> hidden: neu1e += g * syn1
+				// learning weights hidden -> output: syn1 += g * neu1
+				// (both in one pass over syn1)
+				UpdatePair(neu1e, WEIGHT(syn1, l2), neu1, g, layer1_size);
 			}
 			// NEGATIVE SAMPLING
+			// word itself is the positive example (label 1), negative examples
+			// (label 0) are drawn from the unigram table
 			if (negative > 0) for (d = 0; d < negative + 1; d++) {
-				//TODO
+				if (d == 0) {
+					target = word;
+					label = 1;
+				} else {
+					target = SampleNegative(&next_random);
+					if (target == word) continue;
+					label = 0;
+				}
+				l2 = target * layer1_size;
+				f = Dot(neu1, WEIGHT(syn1neg, l2), layer1_size);
+				// out of the range of expTable, the sigmoid is 0 or 1
+				if (f > MAX_EXP) g = (label - 1) * local_alpha;
+				else if (f < -MAX_EXP) g = (label - 0) * local_alpha;
+				else g = (label - expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * local_alpha;
+				// neu1e += g * syn1neg, syn1neg += g * neu1
+				UpdatePair(neu1e, WEIGHT(syn1neg, l2), neu1, g, layer1_size);
 			}
 			// HIDDEN -> IN
+			// the accumulated error goes back to every input word of the window
 			for (a = b; a < window * 2 + 1 -b; a++) if (a != window) {
-				//TODO
+				c = sentence_position - window + a;
+				if (c < 0) continue;
+				if (c >= sentence_length) continue;
+				last_word = sen[c];
+				if (last_word == -1) continue;
+				Axpy(WEIGHT(syn0, last_word * layer1_size), 1, neu1e, layer1_size);
 			}
 		} else { // train skip-gram
-			//TODO
+			// SHARED NEGATIVE SAMPLING (-batch-negative)
+			// all the context words in the window are trained against the SAME target
+			// and negatives, so the dot products make a small nin x nout matrix product
+			// over rows gathered in inm / outm (the 2 x 4 tiles of tile.h), and the
+			// updates two more (din, dout) - every weight row is read and written ONCE
+			// per window instead of once per (context, output) pair
+			if (batch_negative && (negative > 0)) {
+				// gather the inputs - context words around word
+				nin = 0;
+				for (a = b; a < window * 2 + 1 - b; a++) if (a != window) {
+					c = sentence_position - window + a;
+					if (c < 0) continue;
+					if (c >= sentence_length) continue;
+					last_word = sen[c];
+					if (last_word == -1) continue;
+					inw[nin] = last_word;
+					Load(inm + nin * stride, WEIGHT(syn0, last_word * layer1_size), layer1_size);
+					nin++;
+				}
+				// gather the outputs - word itself (label 1) and the negatives (label 0)
+				nout = 0;
+				for (d = 0; d < negative + 1; d++) {
+					if (d == 0) {
+						target = word;
+					} else {
+						target = SampleNegative(&next_random);
+						if (target == word) continue;
+					}
+					outw[nout] = target;
+					Load(outm + nout * stride, WEIGHT(syn1neg, target * layer1_size), layer1_size);
+					nout++;
+				}
+				// corr = inm * outm^T, turned into gradients (multiplied by local_alpha)
+				// (the last tiles may run into the rows past nin / nout, their scores are dropped)
+				for (i = 0; i < nin; i += 2) for (j = 0; j < nout; j += 4) {
+					Tile(inm + i * stride, outm + j * stride, stride, s);
+					for (a = 0; a < 8; a++) {
+						if ((i + a / 4 >= nin) || (j + a % 4 >= nout)) continue;
+						f = s[a];
+						label = (j + a % 4 == 0);
+						if (f > MAX_EXP) g = (label - 1) * local_alpha;
+						else if (f < -MAX_EXP) g = (label - 0) * local_alpha;
+						else g = (label - expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * local_alpha;
+						corr[(i + a / 4) * nout + j + a % 4] = g;
+					}
+				}
+				// din = corr * outm and dout = corr^T * inm, both from the gathered copies
+				// (the weights before this step), then added to the syn0 / syn1neg rows
+				memset(din, 0, nin * stride * sizeof(real));
+				memset(dout, 0, nout * stride * sizeof(real));
+				for (i = 0; i < nin; i++) for (j = 0; j < nout; j++) {
+					AxpyReal(din + i * stride, corr[i * nout + j], outm + j * stride, layer1_size);
+					AxpyReal(dout + j * stride, corr[i * nout + j], inm + i * stride, layer1_size);
+				}
+				for (i = 0; i < nin; i++) Axpy(WEIGHT(syn0, inw[i] * layer1_size), 1, din + i * stride, layer1_size);
+				for (j = 0; j < nout; j++) Axpy(WEIGHT(syn1neg, outw[j] * layer1_size), 1, dout + j * stride, layer1_size);
+			}
+			// every context word (last_word) predicts word on its own -
+			// the input is the syn0 row of last_word instead of neu1
+			// (nothing is left to train here when the window shared the negatives and there is no hs)
+			if (hs || !batch_negative || (negative == 0)) for (a = b; a < window * 2 + 1 - b; a++) if (a != window) {
+				c = sentence_position - window + a;
+				if (c < 0) continue;
+				if (c >= sentence_length) continue;
+				last_word = sen[c];
+				if (last_word == -1) continue;
+				l1 = last_word * layer1_size;
+				memset(neu1e, 0, layer1_size * sizeof(real));
+				// in0 - the input row as real, read in place unless the storage is 16 bit
+				// (then converted once into neu1, which skip-gram does not use otherwise)
+				if (storage) {
+					Load(neu1, WEIGHT(syn0, l1), layer1_size);
+					in0 = neu1;
+				} else in0 = (real *)syn0 + l1;
+				// HIERARCHICAL SOFTMAX
+				if (hs) for (d = 0; d < tree_offset[word + 1] - tree_offset[word]; d++) {
+					l2 = tree_points[tree_offset[word] + d] * layer1_size;
+					// propagate hidden -> output
+					f = Dot(in0, WEIGHT(syn1, l2), layer1_size);
+					if (f <= -MAX_EXP) continue;
+					else if (f >= MAX_EXP) continue;
+					else f = expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))];
+					g = (1 - (real)((tree_codes[word] >> d) & 1) - f) * local_alpha;
+					// neu1e += g * syn1, syn1 += g * syn0
+					UpdatePair(neu1e, WEIGHT(syn1, l2), in0, g, layer1_size);
+				}
+				// NEGATIVE SAMPLING (unless the window shared them above)
+				if ((negative > 0) && !batch_negative) for (d = 0; d < negative + 1; d++) {
+					if (d == 0) {
+						target = word;
+						label = 1;
+					} else {
+						target = SampleNegative(&next_random);
+						if (target == word) continue;
+						label = 0;
+					}
+					l2 = target * layer1_size;
+					f = Dot(in0, WEIGHT(syn1neg, l2), layer1_size);
+					if (f > MAX_EXP) g = (label - 1) * local_alpha;
+					else if (f < -MAX_EXP) g = (label - 0) * local_alpha;
+					else g = (label - expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * local_alpha;
+					UpdatePair(neu1e, WEIGHT(syn1neg, l2), in0, g, layer1_size);
+				}
+				// learning weights input -> hidden
+				Axpy(WEIGHT(syn0, l1), 1, neu1e, layer1_size);
+			}
 		}
 		// next word in sen or SIMPLY refill from file
 		sentence_position++;
@@ -674,125 +2119,714 @@ void *TrainModelThread(void *id) {
 			continue;
 		}
 	}
-	fclose(fi);
+	if (checkpoint_file[0] != 0) {
+		memset(&state, 0, sizeof(state));
+		state.words_done = words_done;
+		SaveThreadState((long long)id, &state);
+	}
+	__sync_fetch_and_add(&threads_done, 1);
 	free(neu1);
 	free(neu1e);
+	free(inm);
+	free(outm);
+	free(corr);
+	free(din);
+	free(dout);
+	free(inw);
+	free(outw);
 	pthread_exit(NULL);
 }
 
+void WidenVectors() {
+	// the 16 bit syn0 back to real for the output
+	long long a;
+	real * v = (real *)malloc(vocab_size * layer1_size * sizeof(real));
+	if (v == NULL) {
+		printf("Memory allocation failed\n");
+		exit(1);
+	}
+	for (a = 0; a < vocab_size; a++) Load(v + a * layer1_size, WEIGHT(syn0, a * layer1_size), layer1_size);
+	free(syn0);
+	syn0 = v;
+	weight_size = sizeof(real);
+}
+
+void SaveModel() {
+	// -binary 2: the format of model.h, the matrix goes out in one write
+	struct model_header h;
+	long long a, pos;
+	long long * index = (long long *)malloc((vocab_size + 1) * sizeof(long long));
+	char pad[MODEL_ALIGN];
+	FILE * fo = fopen(output_file, "wb");
+	if (fo == NULL) {
+		printf("ERROR: cannot open %s!\n", output_file);
+		exit(1);
+	}
+	setvbuf(fo, NULL, _IOFBF, 1 << 22);
+	index[0] = 0;
+	for (a = 0; a < vocab_size; a++) index[a + 1] = index[a] + vocab[a].len + 1;
+	memset(&h, 0, sizeof(h));
+	memset(pad, 0, sizeof(pad));
+	strcpy(h.magic, MODEL_MAGIC);
+	h.vocab_size = vocab_size;
+	h.layer1_size = layer1_size;
+	h.dtype = MODEL_FLOAT32;
+	h.matrix_offset = (sizeof(h) + MODEL_ALIGN - 1) / MODEL_ALIGN * MODEL_ALIGN;
+	// the index and the strings are aligned to MODEL_ALIGN too, the matrix can be an odd
+	// number of floats and the index an odd number of long longs
+	h.index_offset = (h.matrix_offset + vocab_size * layer1_size * sizeof(real) + MODEL_ALIGN - 1) / MODEL_ALIGN * MODEL_ALIGN;
+	h.strings_offset = (h.index_offset + (vocab_size + 1) * sizeof(long long) + MODEL_ALIGN - 1) / MODEL_ALIGN * MODEL_ALIGN;
+	h.file_size = h.strings_offset + index[vocab_size];
+	fwrite(&h, sizeof(h), 1, fo);
+	fwrite(pad, 1, h.matrix_offset - sizeof(h), fo);
+	fwrite(syn0, sizeof(real), vocab_size * layer1_size, fo);
+	fwrite(pad, 1, h.index_offset - h.matrix_offset - vocab_size * layer1_size * sizeof(real), fo);
+	fwrite(index, sizeof(long long), vocab_size + 1, fo);
+	fwrite(pad, 1, h.strings_offset - h.index_offset - (vocab_size + 1) * sizeof(long long), fo);
+	for (a = 0; a < vocab_size; a++) fwrite(vocab[a].word, 1, vocab[a].len + 1, fo);
+	pos = ftell(fo);
+	fclose(fo);
+	free(index);
+	if (pos != h.file_size) {
+		printf("ERROR: cannot write %s!\n", output_file);
+		exit(1);
+	}
+}
+
+// TEXT OUTPUT - rows are formatted in parallel, EXPORT_ROWS rows per thread at a
+// time into its own buffer, and the buffers are written in order
+#define EXPORT_ROWS 1024
+char ** export_buf;
+long long * export_len, export_row;
+
+// powers of 10 from 1e-64 to 1e64, pow10[64 + k] = 10^k
+double pow10_table[129];
+
+void InitPow10() {
+	int k;
+	pow10_table[64] = 1;
+	for (k = 1; k <= 64; k++) {
+		pow10_table[64 + k] = pow10_table[63 + k] * 10;
+		pow10_table[64 - k] = 1 / pow10_table[64 + k];
+	}
+}
+
+// digits * 10^k, exact for |k| <= 22 and correctly rounded then
+static inline double Scale10(double digits, int k) {
+	return (k >= 0) ? digits * pow10_table[64 + k] : digits / pow10_table[64 - k];
+}
+
+int FormatReal(char * out, real x) {
+	// Writes x with precision significant digits, or (precision 0) with the
+	// fewest digits that read back (atof / strtof) as the same float, no locale
+	// returns the length, out needs 24 chars
+	char * p = out, digs[24];
+	double v = x;
+	long long digits;
+	int e, prec, n, i, k;
+	// the read back is compared bit by bit - under -ffast-math a float compare
+	// of a (real) cast may be done in double, without the rounding to float
+	real back;
+	unsigned int back_bits, x_bits;
+	memcpy(&x_bits, &x, sizeof(x_bits));
+	// nan, inf and the sign from the bits - -Ofast (finite math, no signed zeros)
+	// may fold x != x, isinf and signbit away
+	if ((x_bits & 0x7FFFFFFF) > 0x7F800000) return sprintf(out, "nan");
+	if (x_bits >> 31) {
+		*p++ = '-';
+		v = -v;
+	}
+	x_bits &= 0x7FFFFFFF; // v is |x|
+	if (v == 0) {
+		*p++ = '0';
+		return p - out;
+	}
+	if (x_bits == 0x7F800000) return p - out + sprintf(p, "inf");
+	// v = d.ddd * 10^e
+	e = (int)floor(log10(v));
+	for (prec = (precision > 0) ? precision : 1; ; prec++) {
+		digits = llround(Scale10(v, prec - 1 - e));
+		// log10 was just below the power of 10, or the rounding carried over
+		if (digits >= (long long)pow10_table[64 + prec]) {
+			e++;
+			digits = llround(Scale10(v, prec - 1 - e));
+		}
+		if ((precision > 0) || (prec >= 9)) break;
+		// digits * 10^k in double is correctly rounded for |k| <= 22 (and then the
+		// cast too, a double has more than 2 * 24 + 2 bits), strtof does the rest
+		k = e - prec + 1;
+		if ((k >= -22) && (k <= 22)) back = (real)Scale10(digits, k);
+		else {
+			sprintf(digs, "%llde%d", digits, k);
+			back = strtof(digs, NULL);
+		}
+		memcpy(&back_bits, &back, sizeof(back_bits));
+		if (back_bits == x_bits) break;
+	}
+	// digits as a string without the trailing zeros
+	n = prec;
+	for (i = n - 1; i >= 0; i--) {
+		digs[i] = '0' + digits % 10;
+		digits /= 10;
+	}
+	while ((n > 1) && (digs[n - 1] == '0')) n--;
+	if ((e < -5) || (e >= 17)) {
+		// d.ddde-XX
+		*p++ = digs[0];
+		if (n > 1) {
+			*p++ = '.';
+			for (i = 1; i < n; i++) *p++ = digs[i];
+		}
+		return p - out + sprintf(p, "e%c%02d", (e < 0) ? '-' : '+', abs(e));
+	}
+	if (e < 0) {
+		*p++ = '0';
+		*p++ = '.';
+		for (i = -1; i > e; i--) *p++ = '0';
+		for (i = 0; i < n; i++) *p++ = digs[i];
+	} else {
+		for (i = 0; i <= e; i++) *p++ = (i < n) ? digs[i] : '0';
+		if (n > e + 1) {
+			*p++ = '.';
+			for (i = e + 1; i < n; i++) *p++ = digs[i];
+		}
+	}
+	return p - out;
+}
+
+void *SaveTextThread(void *id) {
+	// formats this thread's block of rows of the current round
+	long long a = export_row + (long long)id * EXPORT_ROWS, end = a + EXPORT_ROWS, b;
+	char * p = export_buf[(long long)id];
+	if (end > vocab_size) end = vocab_size;
+	for (; a < end; a++) {
+		memcpy(p, vocab[a].word, vocab[a].len);
+		p += vocab[a].len;
+		*p++ = ' ';
+		for (b = 0; b < layer1_size; b++) {
+			p += FormatReal(p, ((real *)syn0)[a * layer1_size + b]);
+			*p++ = ' ';
+		}
+		*p++ = '\n';
+	}
+	export_len[(long long)id] = p - export_buf[(long long)id];
+	pthread_exit(NULL);
+}
+
+void SaveText() {
+	// the text format of the original, with %lf replaced by FormatReal
+	long long a, t;
+	pthread_t * pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+	FILE * fo = fopen(output_file, "wb");
+	if (fo == NULL) {
+		printf("ERROR: cannot open %s!\n", output_file);
+		exit(1);
+	}
+	InitPow10();
+	export_buf = (char **)malloc(num_threads * sizeof(char *));
+	export_len = (long long *)malloc(num_threads * sizeof(long long));
+	for (t = 0; t < num_threads; t++) {
+		export_buf[t] = (char *)malloc(EXPORT_ROWS * (MAX_STRING + 2 + layer1_size * 25));
+		if (export_buf[t] == NULL) {
+			printf("Memory allocation failed\n");
+			exit(1);
+		}
+	}
+	fprintf(fo, "%lld %lld\n", vocab_size, layer1_size);
+	for (export_row = 0; export_row < vocab_size; export_row += num_threads * EXPORT_ROWS) {
+		for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, SaveTextThread, (void *)a);
+		for (a = 0; a < num_threads; a++) {
+			pthread_join(pt[a], NULL);
+			fwrite(export_buf[a], 1, export_len[a], fo);
+		}
+	}
+	fclose(fo);
+	for (t = 0; t < num_threads; t++) free(export_buf[t]);
+	free(export_buf);
+	free(export_len);
+	free(pt);
+}
+
+void BuildHnsw() {
+	// -hnsw: the graph of the normalized word vectors, saved to <output>.hnsw for distance -ef
+	// (syn0 is normalized in place, the vectors are already written)
+	struct hnsw h;
+	struct timespec t;
+	char name[MAX_STRING + 8];
+	unsigned long long checksum = HNSW_CHECKSUM_INIT;
+	real * v, len;
+	long long a, b;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	for (a = 0; a < vocab_size; a++) {
+		v = (real *)syn0 + a * layer1_size;
+		len = 0;
+		for (b = 0; b < layer1_size; b++) len += v[b] * v[b];
+		len = sqrt(len);
+		if (len > 0) for (b = 0; b < layer1_size; b++) v[b] /= len;
+		checksum = HnswChecksum(checksum, vocab[a].word);
+	}
+	memset(&h, 0, sizeof(h));
+	h.n = vocab_size;
+	h.size = h.stride = layer1_size;
+	h.data = (real *)syn0;
+	h.dot = DotReal;
+	HnswBuild(&h, hnsw_m, hnsw_ef, num_threads);
+	sprintf(name, "%s.hnsw", output_file);
+	if (HnswSave(&h, name, checksum) != 0) {
+		printf("ERROR: cannot write %s!\n", name);
+		exit(1);
+	}
+	if (debug_mode > 0) printf("HNSW index %s built in %.2fs\n", name, SecondsSince(&t));
+	free(h.level);
+	free(h.links0);
+	free(h.upper_offset);
+	free(h.upper);
+}
+
+// K-MEANS of -classes - spherical k-means: a word is in the class of the center closest
+// to it by cosine, a center is the normalized mean of the (normalized) words of its class
+// * W - the normalized word vectors, rows padded with zeros to stride (a multiple of 16
+//   reals) and to an even number of rows, for the tile kernels of tile.h
+// * seeding - k-means|| (Bahmani et al.): KMEANS_ROUNDS rounds, each samples about
+//   classes / 2 candidates, a word with a probability proportional to its distance
+//   (1 - cosine) from the candidates so far; then k-means++ over the candidates, each
+//   weighted by the words closest to it, picks the classes centers
+// * assignment - W times the centers, a blocked matrix product across the threads:
+//   every thread takes a range of rows and scores KMEANS_ROWS of them against
+//   KMEANS_CENTS centers at a time, both blocks stay in the cache
+// * update - the words are bucketed by class, every thread sums the classes of its range
+// * -kmeans-batch - mini-batch k-means (Sculley): an iteration assigns a random batch of
+//   words only and moves their centers towards them, at a rate of 1 / the words the
+//   center has got so far; a last full assignment gives the classes of all the words
+// * stops after -kmeans-iter iterations, or when at most -kmeans-tol of the words (of the
+//   batch) change class - a word seen for the first time counts as changed
+#define KMEANS_ROUNDS 5
+#define KMEANS_ROWS 256
+#define KMEANS_CENTS 256
+
+// rows start..end (even) of rows are scored against the centers first..last of cents,
+// label and score keep the closest center of every row (of n) so far
+struct kmeans_job {
+	real * rows, * cents;
+	long long stride, n, start, end, first, last;
+	int * label;
+	real * score;
+};
+
+// the classes first..last get the normalized sums of their words,
+// the words of class b are member[offset[b]] .. member[offset[b + 1] - 1]
+struct kmeans_update {
+	real * W, * cents;
+	long long stride, first, last;
+	long long * offset, * member;
+};
+
+void * KMeansThread(void * arg) {
+	struct kmeans_job * job = (struct kmeans_job *)arg;
+	long long r0, r1, c0, c1, r, c, i, cc, s = job->stride;
+	real t[8];
+	int j;
+	for (r0 = job->start; r0 < job->end; r0 += KMEANS_ROWS) {
+		r1 = (r0 + KMEANS_ROWS < job->end) ? r0 + KMEANS_ROWS : job->end;
+		for (c0 = job->first; c0 < job->last; c0 += KMEANS_CENTS) {
+			c1 = (c0 + KMEANS_CENTS < job->last) ? c0 + KMEANS_CENTS : job->last;
+			for (r = r0; r < r1; r += 2) for (c = c0; c < c1; c += 4) {
+				Tile(job->rows + r * s, job->cents + c * s, s, t);
+				for (j = 0; j < 8; j++) {
+					i = r + j / 4;
+					cc = c + j % 4;
+					if ((i >= job->n) || (cc >= c1) || (t[j] <= job->score[i])) continue;
+					job->score[i] = t[j];
+					job->label[i] = cc;
+				}
+			}
+		}
+	}
+	pthread_exit(NULL);
+}
+
+void KMeansScore(real * rows, long long n, long long stride, real * cents, long long first, long long last,
+	int * label, real * score) {
+	// the closest of the centers first..last for every row, only a closer one than the
+	// center in label / score so far replaces it (cents has room for 3 rows after last)
+	long long a, pairs = (n + 1) / 2;
+	pthread_t * pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+	struct kmeans_job * jobs = (struct kmeans_job *)malloc(num_threads * sizeof(struct kmeans_job));
+	for (a = 0; a < num_threads; a++) {
+		jobs[a].rows = rows;
+		jobs[a].cents = cents;
+		jobs[a].stride = stride;
+		jobs[a].n = n;
+		jobs[a].start = pairs * a / num_threads * 2;
+		jobs[a].end = pairs * (a + 1) / num_threads * 2;
+		jobs[a].first = first;
+		jobs[a].last = last;
+		jobs[a].label = label;
+		jobs[a].score = score;
+		pthread_create(&pt[a], NULL, KMeansThread, (void *)&jobs[a]);
+	}
+	for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+	free(jobs);
+	free(pt);
+}
+
+void * KMeansUpdateThread(void * arg) {
+	struct kmeans_update * job = (struct kmeans_update *)arg;
+	long long b, c, d, s = job->stride;
+	real * v, len;
+	for (b = job->first; b < job->last; b++) {
+		// an empty class keeps its center
+		if (job->offset[b] == job->offset[b + 1]) continue;
+		v = job->cents + b * s;
+		for (d = 0; d < s; d++) v[d] = 0;
+		for (c = job->offset[b]; c < job->offset[b + 1]; c++)
+			for (d = 0; d < s; d++) v[d] += job->W[job->member[c] * s + d];
+		len = 0;
+		for (d = 0; d < s; d++) len += v[d] * v[d];
+		len = sqrt(len);
+		if (len > 0) for (d = 0; d < s; d++) v[d] /= len;
+	}
+	pthread_exit(NULL);
+}
+
+void KMeansUpdate(real * W, long long n, long long stride, real * cents, long long k, int * label) {
+	long long a, * offset = (long long *)calloc(k + 1, sizeof(long long));
+	long long * member = (long long *)malloc(n * sizeof(long long));
+	pthread_t * pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+	struct kmeans_update * jobs = (struct kmeans_update *)malloc(num_threads * sizeof(struct kmeans_update));
+	// bucket the words by class (counting sort, in word order)
+	for (a = 0; a < n; a++) offset[label[a] + 1]++;
+	for (a = 0; a < k; a++) offset[a + 1] += offset[a];
+	for (a = 0; a < n; a++) member[offset[label[a]]++] = a;
+	for (a = k; a > 0; a--) offset[a] = offset[a - 1];
+	offset[0] = 0;
+	for (a = 0; a < num_threads; a++) {
+		jobs[a].W = W;
+		jobs[a].cents = cents;
+		jobs[a].stride = stride;
+		jobs[a].first = k * a / num_threads;
+		jobs[a].last = k * (a + 1) / num_threads;
+		jobs[a].offset = offset;
+		jobs[a].member = member;
+		pthread_create(&pt[a], NULL, KMeansUpdateThread, (void *)&jobs[a]);
+	}
+	for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+	free(jobs);
+	free(pt);
+	free(member);
+	free(offset);
+}
+
+static inline double KMeansRandom(unsigned long long * next_random) {
+	// uniform in [0, 1), 24 bits of the linear congruential generator of the training
+	*next_random = *next_random * (unsigned long long)25214903917 + 11;
+	return ((*next_random >> 16) & 0xFFFFFF) / 16777216.0;
+}
+
+void KMeansSeed(real * W, long long n, long long stride, real * cents, long long k, unsigned long long * next_random) {
+	// k-means|| seeding of the k centers
+	long long a, b, c, ncand = 0, max_cand = 1024, first = 0, round;
+	long long * cand = (long long *)malloc(max_cand * sizeof(long long));
+	real * C = NULL, * D, * score = (real *)malloc(n * sizeof(real)), x;
+	int * label = (int *)malloc(n * sizeof(int));
+	double phi, total, r, * weight, * dist;
+	if (posix_memalign((void **)&C, 64, (max_cand + 4) * stride * sizeof(real))) C = NULL;
+	if ((cand == NULL) || (C == NULL) || (score == NULL) || (label == NULL)) {
+		printf("Memory allocation failed\n");
+		exit(1);
+	}
+	for (a = 0; a < n; a++) score[a] = -2;
+	// the first candidate is a random word
+	cand[ncand++] = (long long)(KMeansRandom(next_random) * n);
+	for (round = 0; ; round++) {
+		for (a = first; a < ncand; a++) memcpy(C + a * stride, W + cand[a] * stride, stride * sizeof(real));
+		memset(C + ncand * stride, 0, 3 * stride * sizeof(real));
+		KMeansScore(W, n, stride, C, first, ncand, label, score);
+		if (round == KMEANS_ROUNDS) break;
+		phi = 0;
+		for (a = 0; a < n; a++) if (score[a] < 1 - 1e-6) phi += 1 - score[a];
+		if (phi == 0) break;
+		first = ncand;
+		for (a = 0; a < n; a++) {
+			if ((score[a] >= 1 - 1e-6) || (KMeansRandom(next_random) >= k / 2.0 * (1 - score[a]) / phi)) continue;
+			if (ncand == max_cand) {
+				max_cand *= 2;
+				cand = (long long *)realloc(cand, max_cand * sizeof(long long));
+				// C is aligned for the kernels, so a new one instead of realloc
+				if (posix_memalign((void **)&D, 64, (max_cand + 4) * stride * sizeof(real))) D = NULL;
+				if ((cand == NULL) || (D == NULL)) {
+					printf("Memory allocation failed\n");
+					exit(1);
+				}
+				memcpy(D, C, first * stride * sizeof(real));
+				free(C);
+				C = D;
+			}
+			cand[ncand++] = a;
+		}
+	}
+	// k-means++ over the candidates, weighted by the words closest to them
+	// dist - 1 - cosine to the closest center so far, half the squared distance of unit
+	// vectors (the D^2 of k-means++), from 2 (the farthest) before the first center
+	weight = (double *)calloc(ncand, sizeof(double));
+	dist = (double *)malloc(ncand * sizeof(double));
+	for (a = 0; a < n; a++) weight[label[a]]++;
+	for (a = 0; a < ncand; a++) dist[a] = 2;
+	for (b = 0; b < k; b++) {
+		total = 0;
+		for (a = 0; a < ncand; a++) total += weight[a] * dist[a];
+		if (total > 0) {
+			// (the last candidate with a weight if the rounding runs past the end)
+			r = KMeansRandom(next_random) * total;
+			for (a = 0, c = -1; a < ncand; a++) if (weight[a] * dist[a] > 0) {
+				c = a;
+				r -= weight[a] * dist[a];
+				if (r < 0) break;
+			}
+			memcpy(cents + b * stride, C + c * stride, stride * sizeof(real));
+			for (a = 0; a < ncand; a++) {
+				x = 1 - DotReal(C + a * stride, C + c * stride, stride);
+				if (x < 1e-6) x = 0;
+				if (x < dist[a]) dist[a] = x;
+			}
+		} else {
+			// fewer distinct candidates than classes - the rest are random words
+			memcpy(cents + b * stride, W + (long long)(KMeansRandom(next_random) * n) * stride, stride * sizeof(real));
+		}
+	}
+	if (debug_mode > 1) printf("K-means|| seeding: %lld candidates\n", ncand);
+	free(dist);
+	free(weight);
+	free(label);
+	free(score);
+	free(C);
+	free(cand);
+}
+
+int * KMeans() {
+	// the class of every word, see K-MEANS above
+	long long a, b, d, it, changed, k = classes, n = vocab_size, rows = (n + 1) / 2 * 2;
+	long long stride = (layer1_size + 15) / 16 * 16, batch = kmeans_batch;
+	unsigned long long next_random = seed;
+	real * W = NULL, * cents = NULL, * B = NULL, * score, * v, len, eta;
+	int * label = (int *)malloc(n * sizeof(int)), * next, * swap;
+	long long * idx = NULL, * count = NULL;
+	double sum;
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	if (k > n) k = n;
+	if ((batch <= 0) || (batch > n)) batch = 0;
+	next = (int *)malloc(((batch > 0) ? batch : n) * sizeof(int));
+	score = (real *)malloc(((batch > 0) ? batch : n) * sizeof(real));
+	if (posix_memalign((void **)&W, 64, rows * stride * sizeof(real))) W = NULL;
+	if (posix_memalign((void **)&cents, 64, (k + 4) * stride * sizeof(real))) cents = NULL;
+	if ((label == NULL) || (next == NULL) || (score == NULL) || (W == NULL) || (cents == NULL)) {
+		printf("Memory allocation failed\n");
+		exit(1);
+	}
+	memset(W, 0, rows * stride * sizeof(real));
+	memset(cents, 0, (k + 4) * stride * sizeof(real));
+	for (a = 0; a < n; a++) {
+		v = (real *)syn0 + a * layer1_size;
+		len = 0;
+		for (d = 0; d < layer1_size; d++) len += v[d] * v[d];
+		len = sqrt(len);
+		if (len > 0) for (d = 0; d < layer1_size; d++) W[a * stride + d] = v[d] / len;
+	}
+	KMeansSeed(W, n, stride, cents, k, &next_random);
+	for (a = 0; a < n; a++) label[a] = -1;
+	if (batch > 0) {
+		idx = (long long *)malloc(batch * sizeof(long long));
+		count = (long long *)calloc(k, sizeof(long long));
+		if (posix_memalign((void **)&B, 64, (batch + 1) * stride * sizeof(real))) B = NULL;
+		if ((idx == NULL) || (count == NULL) || (B == NULL)) {
+			printf("Memory allocation failed\n");
+			exit(1);
+		}
+		memset(B + batch * stride, 0, stride * sizeof(real));
+	}
+	for (it = 0; it < kmeans_iter; it++) {
+		if (batch > 0) {
+			// a random batch, assigned, then every center moves towards its words
+			for (b = 0; b < batch; b++) {
+				idx[b] = (long long)(KMeansRandom(&next_random) * n);
+				memcpy(B + b * stride, W + idx[b] * stride, stride * sizeof(real));
+				score[b] = -2;
+			}
+			KMeansScore(B, batch, stride, cents, 0, k, next, score);
+			changed = 0;
+			sum = 0;
+			for (b = 0; b < batch; b++) {
+				if (label[idx[b]] != next[b]) changed++;
+				label[idx[b]] = next[b];
+				sum += score[b];
+				v = cents + next[b] * stride;
+				eta = 1.0 / ++count[next[b]];
+				for (d = 0; d < layer1_size; d++) v[d] = (1 - eta) * v[d] + eta * B[b * stride + d];
+			}
+			// back on the unit sphere (again for a center of several words, len is then 1)
+			for (b = 0; b < batch; b++) {
+				v = cents + next[b] * stride;
+				len = 0;
+				for (d = 0; d < layer1_size; d++) len += v[d] * v[d];
+				len = sqrt(len);
+				if (len > 0) for (d = 0; d < layer1_size; d++) v[d] /= len;
+			}
+			if (debug_mode > 1) printf("K-means batch %lld: %lld of %lld words changed class, mean cosine %.4f\n",
+				it + 1, changed, batch, sum / batch);
+			if (changed <= kmeans_tol * batch) break;
+			continue;
+		}
+		for (a = 0; a < n; a++) score[a] = -2;
+		KMeansScore(W, n, stride, cents, 0, k, next, score);
+		changed = 0;
+		sum = 0;
+		for (a = 0; a < n; a++) {
+			if (label[a] != next[a]) changed++;
+			sum += score[a];
+		}
+		swap = label;
+		label = next;
+		next = swap;
+		if (debug_mode > 1) printf("K-means iteration %lld: %lld words changed class, mean cosine %.4f\n",
+			it + 1, changed, sum / n);
+		if ((changed <= kmeans_tol * n) || (it == kmeans_iter - 1)) break;
+		KMeansUpdate(W, n, stride, cents, k, label);
+	}
+	if (batch > 0) {
+		// the classes of all the words, with the final centers
+		free(score);
+		score = (real *)malloc(n * sizeof(real));
+		for (a = 0; a < n; a++) score[a] = -2;
+		KMeansScore(W, n, stride, cents, 0, k, label, score);
+		free(B);
+		free(count);
+		free(idx);
+	}
+	if (debug_mode > 0) printf("K-means: %lld classes in %.2fs\n", k, SecondsSince(&t));
+	free(score);
+	free(next);
+	free(cents);
+	free(W);
+	return label;
+}
+
+void WriteReport() {
+	// Appends one CSV row about this run to report_file, with the header
+	// if the file is new - see bench.sh
+	struct rusage ru;
+	FILE * fo = fopen(report_file, "a");
+	if (fo == NULL) {
+		printf("ERROR: cannot open %s!\n", report_file);
+		return;
+	}
+	getrusage(RUSAGE_SELF, &ru);
+	fseek(fo, 0, SEEK_END);
+	if (ftell(fo) == 0) fprintf(fo, "train_file,cbow,hs,negative,batch_negative,size,window,sample,threads,iter,"
+		"vocab_size,train_words,words_per_sec,words_per_sec_thread,"
+		"vocab_secs,tree_secs,init_secs,train_secs,save_secs,peak_rss_kb\n");
+	fprintf(fo, "%s,%d,%d,%d,%d,%lld,%d,%g,%d,%d,%lld,%lld,%.0f,%.0f,%.3f,%.3f,%.3f,%.3f,%.3f,%ld\n",
+		(read_ids_file[0] != 0) ? read_ids_file : train_file, cbow, hs, negative, batch_negative,
+		layer1_size, window, sample, num_threads, iter, vocab_size, train_words,
+		(word_count_actual - resume_words) / (train_secs + 1e-9), (word_count_actual - resume_words) / (train_secs + 1e-9) / num_threads,
+		vocab_secs, tree_secs, init_secs, train_secs, save_secs, ru.ru_maxrss);
+	fclose(fo);
+}
+
 void TrainModel(){
-	long a, b, c, d;
+	long a;
 	FILE * fo;
+	// phase timing
+	struct timespec t;
 	// threads objects
 	pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
-	printf("Starting training using file %s\n", train_file);
+	printf("Starting training using file %s\n", (read_ids_file[0] != 0) ? read_ids_file : train_file);
 
 	starting_alpha = alpha;
+	clock_gettime(CLOCK_MONOTONIC, &t);
 	// build vocab either from vocab file or train file
 	if (read_vocab_file[0] != 0) ReadVocab(); else LearnVocabFromTrainFile();
 	// save it if required
 	if (save_vocab_file[0] != 0) SaveVocab();
+	// one-time encoding of the train file to vocab indices
+	if (save_ids_file[0] != 0) SaveIds();
+	if (read_ids_file[0] != 0) MapIdsFile();
+	vocab_secs = SecondsSince(&t);
+
+	// the tree is only used by hierarchical softmax, or saved alongside the vocab
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	if (hs || (save_tree_file[0] != 0)) {
+		if (read_tree_file[0] != 0) ReadTree(); else CreateBinaryTree();
+	}
+	if (save_tree_file[0] != 0) SaveTree();
+	tree_secs = SecondsSince(&t);
 	if (output_file[0] == 0) return;
 
+	clock_gettime(CLOCK_MONOTONIC, &t);
 	InitNet();
+	if (sample > 0) InitKeepThresholds();
 
-	if (negative > 0) InitUnigramTable(); // negative sampling
+	// negative sampling
+	if (negative > 0) {
+		if (unigram_table) InitUnigramTable(); else InitAliasTable();
+	}
+	if (posix_memalign((void **)&progress, 64, num_threads * sizeof(struct progress_counter)) != 0) progress = NULL;
+	if (progress == NULL) {
+		printf("Memory allocation failed\n");
+		exit(1);
+	}
+	memset(progress, 0, num_threads * sizeof(struct progress_counter));
+	if (resume_file[0] != 0) ReadCheckpoint();
+	init_secs = SecondsSince(&t);
 
 	// create threads to do training and block-wait
-	start = clock();
+	if (checkpoint_file[0] != 0) {
+		if (posix_memalign((void **)&thread_checkpoints, 128, num_threads * sizeof(struct thread_checkpoint)) != 0) thread_checkpoints = NULL;
+		if (thread_checkpoints == NULL) {
+			printf("Memory allocation failed\n");
+			exit(1);
+		}
+		memset(thread_checkpoints, 0, num_threads * sizeof(struct thread_checkpoint));
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	// pass a instead of &a, as "a" is a local variable
 	for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, TrainModelThread, (void *)a);
+	if (checkpoint_file[0] != 0) WaitForTraining();
 	for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+	for (a = 0; a < num_threads; a++) word_count_actual += progress[a].words;
+	train_secs = SecondsSince(&start);
+	if (debug_mode > 0) printf("\nTraining time: %.2fs\n", train_secs);
+	if (storage) WidenVectors();
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
 
 	// write output file
+	if ((classes == 0) && (binary != 1)) {
+		if (binary == 2) SaveModel(); else SaveText();
+		save_secs = SecondsSince(&t);
+		if (hnsw_m > 0) BuildHnsw();
+		if (report_file[0] != 0) WriteReport();
+		return;
+	}
 	fo = fopen(output_file, "wb");
-	// save word vectors
+	setvbuf(fo, NULL, _IOFBF, 1 << 22);
+	// save word vectors (binary, text is written by SaveText)
 	if (classes == 0) {
 		fprintf(fo, "%lld %lld\n", vocab_size, layer1_size);
 		for (a = 0; a < vocab_size; a++) {
 			fprintf(fo, "%s ", vocab[a].word);
-			if (binary) {
-				for (b = 0; b < layer1_size; b++) 
-					fwrite(&syn0[a * layer1_size + b], sizeof(real), 1, fo);
-			} else {
-				for (b = 0; b < layer1_size; b++)
-					fprintf(fo, "%lf ", syn0[a * layer1_size + b]);
-			}
+			fwrite((real *)syn0 + a * layer1_size, sizeof(real), layer1_size, fo);
 			fprintf(fo, "\n");
 		}
 	} else { // save the word classes
-		// run kmeans on word vectors to get word classes
-		int clcn = classes, iter = 0, closeid;
-		// sizes of each cluster
-		int *centcn = (int *)malloc(classes * sizeof(int));
-		// classes of each word in vocab
-		int *cl = (int *)calloc(vocab_size, sizeof(int));
-		real closev, x;
-		// center vector
-		real *cent = (real *)calloc(classes * layer1_size, sizeof(real));
-		// initialize class labels of words in a wheel way
-		for (a = 0; a < vocab_size; a++) cl[a] = a % clcn;
-		// iterative training
-		for (a = 0; a < iter; a++) {
-			// reset centers to all zeros
-			for (b = 0; b < clcn * layer1_size; b++) cent[b] = 0;
-			// reset cluster size to 1 element
-			for (b = 0; b < clcn; b++) centcn[b] = 1;
-			// for each word (for each feature of it)
-			// center_vec += word_vec
-			// center_size += 1
-			for (c = 0; c < vocab_size; c++) {
-				for (d = 0; d < layer1_size; d++) {
-					// cl[c] is the cluster index of word at c
-					cent[layer1_size * cl[c] + d] += syn0[c * layer1_size + d];
-					centcn[cl[c]]++;
-				}
-			}
-			// for each cluster (for each feature of cluster center)
-			// cent_vec /= cluster_size
-			// cent_vec `~ normalized by l2 norm
-			for (b = 0; b < clcn; b++) {
-				closev = 0;
-				for (c = 0; c < layer1_size; c++) {
-					// taking average
-					cent[layer1_size * b + c] /= centcn[b];
-					closev += cent[layer1_size * b + c] * cent[layer1_size * b + c];
-				}
-				// closev = l2 norm of the center vec
-				// normalize the center vec by its l2 norm
-				// NORMALIZATION OF CENTER VECTORS FOR LATER DISTANCE COMPARISON
-				closev = sqrt(closev);
-				for (c = 0; c < layer1_size; c++) cent[layer1_size * b + c] /= closev;
-			}
-			// ASSIGN each word to the corresponding center
-			// for each word, for each cluster, 
-			// calculate the dist between the word vec and the cluster center 
-			// (cluster vecs have all been normalized, so just use the inner product)
-			// find the closest cluster center to the current word vector
-			// closev (the closest dist so far), closeid (the closest cluster id so far)
-			for (c = 0; c < vocab_size; c++) {
-				closev = -10;
-				closeid = 0;
-				for (d = 0; d < clcn; d++) {
-					x = 0;
-					for (b = 0; b < layer1_size; b++)
-						x += cent[layer1_size * d + b] * syn0[c * layer1_size + b];
-					if (x > closev) {
-						closev = x;
-						closeid = d;
-					}
-				}
-				cl[c] = closeid;
-			}
-		}
-		// save the kmeans classes
-		for (a = 0; a < vocab_size; a++)
-			fprintf(fo, "%s %d\n", vocab[a].word, cl[a]);
-		free(centcn);
-		free(cent);
+		int * cl = KMeans();
+		for (a = 0; a < vocab_size; a++) fprintf(fo, "%s %d\n", vocab[a].word, cl[a]);
 		free(cl);
 	}
 	fclose(fo);
+	save_secs = SecondsSince(&t);
+	if (hnsw_m > 0) BuildHnsw(); // (not with -classes, see main)
+	if (report_file[0] != 0) WriteReport();
 }
 
 // parse the command line arguments
@@ -832,6 +2866,12 @@ int main(int argc, char ** argv) {
     printf("\t\tUse Hierarchical Softmax; default is 1 (0 = not used)\n");
     printf("\t-negative <int>\n");
     printf("\t\tNumber of negative examples; default is 0, common values are 5 - 10 (0 = not used)\n");
+    printf("\t-unigram-table <int>\n");
+    printf("\t\tDraw the negative examples from the 400MB unigram table instead of the alias table; default is 0 (off)\n");
+    printf("\t-batch-negative <int>\n");
+    printf("\t\tShare one set of negative examples across the whole context window (skip-gram), trained as a small matrix product; default is 0 (off)\n");
+    printf("\t-iter <int>\n");
+    printf("\t\tRun more training iterations (epochs); default is 1\n");
     printf("\t-threads <int>\n");
     printf("\t\tUse <int> threads (default 1)\n");
     printf("\t-min-count <int>\n");
@@ -840,14 +2880,50 @@ int main(int argc, char ** argv) {
     printf("\t\tSet the starting learning rate; default is 0.025\n");
     printf("\t-classes <int>\n");
     printf("\t\tOutput word classes rather than word vectors; default number of classes is 0 (vectors are written)\n");
+    printf("\t-kmeans-iter <int>\n");
+    printf("\t\tMost k-means iterations of -classes; default is 10\n");
+    printf("\t-kmeans-tol <float>\n");
+    printf("\t\tStop the k-means when at most this fraction of the words change class; default is 0.001\n");
+    printf("\t-kmeans-batch <int>\n");
+    printf("\t\tWords of a mini-batch k-means iteration; default is 0 (every iteration assigns all the words)\n");
     printf("\t-debug <int>\n");
     printf("\t\tSet the debug mode (default = 2 = more info during training)\n");
     printf("\t-binary <int>\n");
-    printf("\t\tSave the resulting vectors in binary moded; default is 0 (off)\n");
+    printf("\t\tSave the resulting vectors in binary moded; default is 0 (off), 2 is a file that can be mapped as a matrix (see model.h)\n");
+    printf("\t-precision <int>\n");
+    printf("\t\tSignificant digits of the text vectors; default is 0 (the fewest that read back as the same float)\n");
+    printf("\t-hnsw <int>\n");
+    printf("\t\tBuild an HNSW index of the word vectors with <int> links per node (e.g. 16) for distance -ef, saved to <output>.hnsw; default is 0 (off)\n");
+    printf("\t-hnsw-ef <int>\n");
+    printf("\t\tCandidates kept while building the HNSW index, more is slower and better; default is 200\n");
     printf("\t-save-vocab <file>\n");
     printf("\t\tThe vocabulary will be saved to <file>\n");
     printf("\t-read-vocab <file>\n");
     printf("\t\tThe vocabulary will be read from <file>, not constructed from the training data\n");
+    printf("\t-save-ids <file>\n");
+    printf("\t\tThe training data will be encoded to vocabulary indices and saved to <file>, to be used with -read-ids\n");
+    printf("\t-read-ids <file>\n");
+    printf("\t\tTrain on the indices in <file> (written by -save-ids) instead of the text; requires -read-vocab with the same vocabulary. The vectors are the same as from the text with -threads 1 only, the threads split the indices at other places than the text\n");
+    printf("\t-ids-width <int>\n");
+    printf("\t\tBytes per index for -save-ids: 2, 4 or 0 (variable length); default is 0\n");
+    printf("\t-save-tree <file>\n");
+    printf("\t\tThe Huffman tree of the vocabulary will be saved to <file>\n");
+    printf("\t-read-tree <file>\n");
+    printf("\t\tThe Huffman tree will be read from <file> (written by -save-tree for the same vocabulary), not constructed\n");
+    printf("\t-checkpoint <file>\n");
+    printf("\t\tSave the training state to <file> every -checkpoint-interval seconds (and the vocabulary to <file>.vocab)\n");
+    printf("\t-checkpoint-interval <int>\n");
+    printf("\t\tSeconds between two checkpoints; default is 600\n");
+    printf("\t-resume <file>\n");
+    printf("\t\tCarry on from the checkpoint <file>, with the same options (the vocabulary is read from <file>.vocab unless -read-vocab is given)\n");
+    printf("\t-storage <int>\n");
+    printf("\t\tStore the weights as 32 bit floats (0), bfloat16 (1) or half floats (2) during training; default is 0\n");
+    printf("\t-seed <int>\n");
+    printf("\t\tSeed of the initial word vectors; default is 1\n");
+    printf("\t-numa <int>\n");
+    printf("\t\tPin the threads to cpus and spread the weights over the numa nodes by first touch (1) or interleaving (2); default is 0 (off)\n");
+    printf("\t-report <file>\n");
+    printf("\t\tAppend the timing of the phases, words/sec and peak memory of the run to <file> as a CSV row\n");
     printf("\t-cbow <int>\n");
     printf("\t\tUse the continuous back of words model; default is 0 (skip-gram model)\n");
     printf("\nExamples:\n");
@@ -858,13 +2934,45 @@ int main(int argc, char ** argv) {
   output_file[0] = 0;
   save_vocab_file[0] = 0;
   read_vocab_file[0] = 0;
+  save_ids_file[0] = 0;
+  report_file[0] = 0;
+  save_tree_file[0] = 0;
+  checkpoint_file[0] = 0;
+  resume_file[0] = 0;
+  read_tree_file[0] = 0;
+  read_ids_file[0] = 0;
   // parse the arguments 
   if ((i = ArgPos((char *)"-size", argc, argv)) > 0) layer1_size = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-train", argc, argv)) > 0) strcpy(train_file, argv[i + 1]);
   if ((i = ArgPos((char *)"-save-vocab", argc, argv)) > 0) strcpy(save_vocab_file, argv[i + 1]);
   if ((i = ArgPos((char *)"-read-vocab", argc, argv)) > 0) strcpy(read_vocab_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-save-ids", argc, argv)) > 0) strcpy(save_ids_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-read-ids", argc, argv)) > 0) strcpy(read_ids_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-ids-width", argc, argv)) > 0) ids_width = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-save-tree", argc, argv)) > 0) strcpy(save_tree_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-read-tree", argc, argv)) > 0) strcpy(read_tree_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-checkpoint", argc, argv)) > 0) strcpy(checkpoint_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-checkpoint-interval", argc, argv)) > 0) checkpoint_interval = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-resume", argc, argv)) > 0) strcpy(resume_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-storage", argc, argv)) > 0) storage = atoi(argv[i + 1]);
+  if ((storage < 0) || (storage > 2)) {
+    printf("ERROR: -storage must be 0, 1 or 2\n");
+    exit(1);
+  }
+  if (storage) weight_size = 2;
+  if ((i = ArgPos((char *)"-seed", argc, argv)) > 0) seed = strtoull(argv[i + 1], NULL, 10);
+  if ((i = ArgPos((char *)"-numa", argc, argv)) > 0) numa = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-report", argc, argv)) > 0) strcpy(report_file, argv[i + 1]);
   if ((i = ArgPos((char *)"-debug", argc, argv)) > 0) debug_mode = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-binary", argc, argv)) > 0) binary = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-precision", argc, argv)) > 0) precision = atoi(argv[i + 1]);
+  if (precision > 17) precision = 17;
+  if ((i = ArgPos((char *)"-hnsw", argc, argv)) > 0) hnsw_m = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-hnsw-ef", argc, argv)) > 0) hnsw_ef = atoi(argv[i + 1]);
+  if ((hnsw_m == 1) || (hnsw_m < 0)) {
+    printf("ERROR: -hnsw must be 0 or at least 2\n");
+    return 1;
+  }
   if ((i = ArgPos((char *)"-cbow", argc, argv)) > 0) cbow = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-alpha", argc, argv)) > 0) alpha = atof(argv[i + 1]);
   if ((i = ArgPos((char *)"-output", argc, argv)) > 0) strcpy(output_file, argv[i + 1]);
@@ -872,12 +2980,44 @@ int main(int argc, char ** argv) {
   if ((i = ArgPos((char *)"-sample", argc, argv)) > 0) sample = atof(argv[i + 1]);
   if ((i = ArgPos((char *)"-hs", argc, argv)) > 0) hs = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-negative", argc, argv)) > 0) negative = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-unigram-table", argc, argv)) > 0) unigram_table = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-batch-negative", argc, argv)) > 0) batch_negative = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-iter", argc, argv)) > 0) iter = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-min-count", argc, argv)) > 0) min_count = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-classes", argc, argv)) > 0) classes = atoi(argv[i + 1]);
-  // allocate memory for vocab, vocab_hash, and expTable table
+  if ((i = ArgPos((char *)"-kmeans-iter", argc, argv)) > 0) kmeans_iter = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-kmeans-tol", argc, argv)) > 0) kmeans_tol = atof(argv[i + 1]);
+  if ((i = ArgPos((char *)"-kmeans-batch", argc, argv)) > 0) kmeans_batch = atoll(argv[i + 1]);
+  if (cbow && batch_negative) {
+    printf("ERROR: -batch-negative is for skip-gram, it cannot be combined with -cbow 1\n");
+    exit(1);
+  }
+  if ((classes > 0) && (hnsw_m > 0)) {
+    printf("ERROR: -hnsw indexes the word vectors, it cannot be combined with -classes\n");
+    exit(1);
+  }
+  if ((classes > 0) && (kmeans_iter < 1)) {
+    printf("ERROR: -kmeans-iter must be positive\n");
+    exit(1);
+  }
+  // a checkpoint is only meaningful with its vocab - saved next to it, read back by -resume
+  if ((checkpoint_file[0] != 0) && (save_vocab_file[0] == 0) && (strlen(checkpoint_file) < MAX_STRING - 6))
+    sprintf(save_vocab_file, "%s.vocab", checkpoint_file);
+  if ((resume_file[0] != 0) && (read_vocab_file[0] == 0) && (strlen(resume_file) < MAX_STRING - 6))
+    sprintf(read_vocab_file, "%s.vocab", resume_file);
+  // the indices only make sense with the vocab they were encoded with
+  if ((read_ids_file[0] != 0) && ((read_vocab_file[0] == 0) || (save_ids_file[0] != 0))) {
+    printf("ERROR: -read-ids needs -read-vocab and cannot be combined with -save-ids\n");
+    exit(1);
+  }
+  if ((ids_width != 0) && (ids_width != 2) && (ids_width != 4)) {
+    printf("ERROR: -ids-width must be 0 (varint), 2 or 4\n");
+    exit(1);
+  }
+  // allocate memory for vocab and expTable table, the vocab hash table
+  // grows with the vocab (see BuildIndex)
   vocab = (struct vocab_word *)calloc(vocab_max_size, sizeof(struct vocab_word));
-  vocab_hash = (int *)calloc(vocab_hash_size, sizeof(int));
   // precomputing exponetial table 
   expTable = (real *)malloc((EXP_TABLE_SIZE + 1) * sizeof(real));
   for (i = 0; i < EXP_TABLE_SIZE; i++) {
@@ -886,6 +3026,8 @@ int main(int argc, char ** argv) {
   	// Precompute f(x) = x / (x + 1)
   	expTable[i] = expTable[i] / (expTable[i] + 1);
   }
+  InitKernels();
+  if (numa) InitCpus();
   TrainModel();
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,140 @@
+//  Generates a deterministic synthetic corpus for benchmarking word2vec
+//  Word ranks follow a Zipf distribution, p(r) ~ 1 / r^s, and sentences have a random
+//  length so the </s> handling and the sentence loop see realistic input.
+//  The same options always produce the same file, no matter the machine.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define MAX_STRING 100
+
+char output_file[MAX_STRING];
+long long words = 10000000, vocab = 100000, sentence = 20;
+unsigned long long seed = 1;
+double exponent = 1.0;
+double *cdf;
+
+// same linear congruential generator as word2vec, so no dependency on the libc rand()
+unsigned long long next_random;
+
+double NextUniform() {
+	next_random = next_random * (unsigned long long)25214903917 + 11;
+	return (next_random >> 11) / (double)(1ULL << 53);
+}
+
+// cumulative distribution over the ranks 1..vocab
+void InitCdf() {
+	long long a;
+	double sum = 0;
+	cdf = (double *)malloc(vocab * sizeof(double));
+	if (cdf == NULL) {
+		printf("Memory allocation failed\n");
+		exit(1);
+	}
+	for (a = 0; a < vocab; a++) {
+		sum += 1.0 / pow(a + 1, exponent);
+		cdf[a] = sum;
+	}
+	for (a = 0; a < vocab; a++) cdf[a] /= sum;
+}
+
+// binary search for the first rank whose cdf is >= u
+long long SampleRank(double u) {
+	long long lo = 0, hi = vocab - 1, mid;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (cdf[mid] < u) lo = mid + 1; else hi = mid;
+	}
+	return lo;
+}
+
+// word strings are a base-26 spelling of the rank, so frequent words are short like in real text
+void RankToWord(long long rank, char *word) {
+	int len = 0, a;
+	char tmp;
+	do {
+		word[len++] = 'a' + rank % 26;
+		rank /= 26;
+	} while (rank > 0);
+	word[len] = 0;
+	for (a = 0; a < len / 2; a++) {
+		tmp = word[a];
+		word[a] = word[len - 1 - a];
+		word[len - 1 - a] = tmp;
+	}
+}
+
+void GenerateCorpus() {
+	long long a, left = 0;
+	char word[MAX_STRING];
+	FILE *fo = fopen(output_file, "wb");
+	if (fo == NULL) {
+		printf("ERROR: cannot open %s!\n", output_file);
+		exit(1);
+	}
+	next_random = seed;
+	for (a = 0; a < words; a++) {
+		if (left == 0) {
+			// sentence length uniform in [1, 2 * sentence - 1]
+			left = 1 + (long long)(NextUniform() * (2 * sentence - 1));
+			if (a > 0) fputc('\n', fo);
+		} else fputc(' ', fo);
+		RankToWord(SampleRank(NextUniform()), word);
+		fputs(word, fo);
+		left--;
+	}
+	fputc('\n', fo);
+	fclose(fo);
+}
+
+int ArgPos(char *str, int argc, char **argv) {
+	int a;
+	for (a = 1; a < argc; a++) if (!strcmp(str, argv[a])) {
+		if (a == argc - 1) {
+			printf("Argument missing for %s\n", str);
+			exit(1);
+		}
+		return a;
+	}
+	return -1;
+}
+
+int main(int argc, char **argv) {
+	int i;
+	if (argc == 1) {
+		printf("Synthetic Zipf corpus generator\n\n");
+		printf("Options:\n");
+		printf("\t-output <file>\n");
+		printf("\t\tUse <file> to save the corpus\n");
+		printf("\t-words <int>\n");
+		printf("\t\tNumber of words to generate; default is 10000000\n");
+		printf("\t-vocab <int>\n");
+		printf("\t\tNumber of distinct words; default is 100000\n");
+		printf("\t-exponent <float>\n");
+		printf("\t\tZipf exponent of the word distribution; default is 1.0\n");
+		printf("\t-sentence <int>\n");
+		printf("\t\tAverage sentence length in words; default is 20\n");
+		printf("\t-seed <int>\n");
+		printf("\t\tSeed of the random generator; default is 1\n");
+		printf("\nExamples:\n");
+		printf("./zipf-corpus -output zipf.txt -words 10000000 -vocab 100000\n\n");
+		return 0;
+	}
+	output_file[0] = 0;
+	if ((i = ArgPos((char *)"-output", argc, argv)) > 0) strcpy(output_file, argv[i + 1]);
+	if ((i = ArgPos((char *)"-words", argc, argv)) > 0) words = atoll(argv[i + 1]);
+	if ((i = ArgPos((char *)"-vocab", argc, argv)) > 0) vocab = atoll(argv[i + 1]);
+	if ((i = ArgPos((char *)"-exponent", argc, argv)) > 0) exponent = atof(argv[i + 1]);
+	if ((i = ArgPos((char *)"-sentence", argc, argv)) > 0) sentence = atoll(argv[i + 1]);
+	if ((i = ArgPos((char *)"-seed", argc, argv)) > 0) seed = strtoull(argv[i + 1], NULL, 10);
+	if (output_file[0] == 0 || words < 1 || vocab < 1 || sentence < 1) {
+		printf("ERROR: -output is required and -words, -vocab, -sentence must be positive\n");
+		return 1;
+	}
+	InitCdf();
+	GenerateCorpus();
+	free(cdf);
+	return 0;
+}